@@ -32,7 +32,7 @@ void _EEPROM_readData(int &pos, uint8_t *value, uint8_t size)
 // the default values are used whenever there is a change to the data, to prevent
 // wrong data being written to the variables.
 // ALSO:  always make sure the variables in the Store and retrieve sections are in the same order.
-#define EEPROM_VERSION "V08"
+#define EEPROM_VERSION "V09"
 
 #ifdef EEPROM_SETTINGS
 
@@ -263,6 +263,14 @@ void Config_StoreSettings()
     EEPROM_WRITE_VAR(i, tl_Filament_Detect);
 #endif
 
+#ifdef THERMAL_MODEL_PROTECTION
+    EEPROM_WRITE_VAR(i, tm_gain);
+    EEPROM_WRITE_VAR(i, tm_tau);
+    EEPROM_WRITE_VAR(i, tm_tolerance);
+    EEPROM_WRITE_VAR(i, tm_count);
+    EEPROM_WRITE_VAR(i, tm_enabled);
+#endif
+
 #ifndef DOGLCD
     int lcd_contrast = 32;
 #endif
@@ -341,6 +349,25 @@ void Config_PrintSettings()
     SERIAL_ECHOPAIR(" D", unscalePID_d(Kd));
     SERIAL_ECHOLN("");
 #endif
+#ifdef THERMAL_MODEL_PROTECTION
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM("Thermal model:");
+    for (short h = 0; h <= EXTRUDERS; h++)
+    {
+        SERIAL_ECHO_START;
+        SERIAL_ECHOPGM("   M310 E");
+        SERIAL_ECHO(h == EXTRUDERS ? -1 : h);
+        SERIAL_ECHOPAIR(" G", tm_gain[h]);
+        SERIAL_ECHOPAIR(" C", tm_tau[h]);
+        SERIAL_ECHOPGM(" R");
+        SERIAL_ECHO(tm_tolerance);
+        SERIAL_ECHOPGM(" N");
+        SERIAL_ECHO(tm_count);
+        SERIAL_ECHOPGM(" S");
+        SERIAL_ECHO((int)tm_enabled);
+        SERIAL_ECHOLN("");
+    }
+#endif
 #ifdef CONFIG_TL
     SERIAL_ECHO_START;
     SERIAL_ECHOLNPGM("Secondery Max Pos:");
@@ -464,6 +491,16 @@ void Config_RetrieveSettings()
         EEPROM_READ_VAR(i, tl_Filament_Detect);
 #endif
 
+#ifdef THERMAL_MODEL_PROTECTION
+        EEPROM_READ_VAR(i, tm_gain);
+        EEPROM_READ_VAR(i, tm_tau);
+        EEPROM_READ_VAR(i, tm_tolerance);
+        EEPROM_READ_VAR(i, tm_count);
+        tm_count = constrain(tm_count, 1, 255);
+        EEPROM_READ_VAR(i, tm_enabled);
+        thermal_model_reset();
+#endif
+
 #ifndef DOGLCD
         int lcd_contrast;
 #endif
@@ -566,6 +603,18 @@ void Config_ResetDefault()
     tl_Filament_Detect = 1;
 #endif
 
+#ifdef THERMAL_MODEL_PROTECTION
+    for (short h = 0; h <= EXTRUDERS; h++)
+    {
+        tm_gain[h] = 0;
+        tm_tau[h] = 0;
+    }
+    tm_tolerance = THERMAL_MODEL_TOLERANCE;
+    tm_count = THERMAL_MODEL_COUNT;
+    tm_enabled = true;
+    thermal_model_reset();
+#endif
+
 #ifdef TL_TJC_CONTROLLER
     tl_SLEEP_TIME = 0;
 #endif
@@ -24,6 +24,61 @@
 #define WATCH_TEMP_FALL 30          //Temp fall down 20 degree in 10 seconds.
 #endif
 
+// Free running ADC: conversions are chained from the ADC complete interrupt instead of
+// one conversion every other timer0 tick. Every sample is the median of TEMP_ADC_MEDIAN
+// back to back conversions (rejects single glitches from heater/stepper switching),
+// TEMP_ADC_OVERSAMPLE samples are summed and rescaled to OVERSAMPLENR so the thermistor
+// tables and PID_dT stay unchanged. Comment out to go back to the timer state machine.
+#define TEMP_ADC_FREE_RUNNING
+#ifdef TEMP_ADC_FREE_RUNNING
+#define TEMP_ADC_MEDIAN 3     // 1, 3 or 5 conversions per sample
+#define TEMP_ADC_OVERSAMPLE 16 // samples per reading, power of 2 (4..64), times TEMP_ADC_MEDIAN below 307
+#endif
+
+// Thermal model protection: every heater gets a first order model (gain and time constant)
+// that is learned by M303 autotune, or set with M310. The expected temperature is computed
+// from the applied soft pwm; when the reading leaves the model by more than the tolerance for
+// THERMAL_MODEL_COUNT readings in a row (~0.13s each) the heater is shut down.
+// Catches a thermistor that fell out of the block, a dead heater or a stuck mosfet in seconds.
+// Works next to the WATCH_TEMP checks above, heaters without a model are not checked.
+#define THERMAL_MODEL_PROTECTION
+#ifdef THERMAL_MODEL_PROTECTION
+#define THERMAL_MODEL_AMBIENT 25     // degC the model heats up from
+#define THERMAL_MODEL_TOLERANCE 20   // degC between model and reading (M310 R)
+#define THERMAL_MODEL_COUNT 10       // readings out of tolerance before shut down (M310 N)
+#define THERMAL_MODEL_TRACKING 0.01  // how fast the model follows the reading, per reading
+#endif
+
+// Heater telemetry: keeps the last TEMP_TELEMETRY_SIZE samples of temperature, target and soft pwm
+// of every heater plus the part fan in RAM (20 bytes per sample with 2 extruders, 480 bytes as set).
+// M1060 dumps them as CSV, M1060 F1 writes them to TEMP_TELEMETRY_FILE on the SD card root.
+// While a file prints from SD the samples are appended to TEMP_TELEMETRY_FILE instead, so it covers
+// the whole print. M1060 I<ms> sets the sample interval (0 stops sampling), M1060 C clears the buffer.
+//#define TEMP_TELEMETRY
+#ifdef TEMP_TELEMETRY
+#define TEMP_TELEMETRY_SIZE 24
+#define TEMP_TELEMETRY_INTERVAL 5000 // ms
+#define TEMP_TELEMETRY_FILE "TEMPLOG.CSV"
+#endif
+
+// Start G-code heats the bed and then the nozzle (M190 ... M109). With this, M190 and M109 look at
+// the queued commands behind them and switch on the heaters of the M104/M109/M140/M190 that follow,
+// so both waits run at the same time. M1070 L0/L1 turns it off/on, M1070 H<nozzle> B<bed> heats both and waits.
+#define HEAT_WAIT_LOOKAHEAD
+
+// PSU budget in watts for all heaters together, hotends go first and the bed gets what is left.
+// Set it to what your power supply can give the heaters, and the heater wattages to what is fitted
+// (from their rating or U*U/R); the numbers below are only an example, so it is off by default.
+//#define HEATER_POWER_BUDGET 320
+#ifdef HEATER_POWER_BUDGET
+#define HOTEND_WATTS 40
+#define BED_WATTS 220
+#endif
+
+// M155 S<seconds> makes the firmware send the M105 temperature line by itself from the main loop,
+// so the host does not have to poll with M105 and take a command buffer slot. M155 S0 stops it.
+#define AUTO_REPORT_TEMPERATURES
+
 #ifdef PIDTEMP
 // this adds an experimental additional term to the heatingpower, proportional to the extrusion speed.
 // if Kc is choosen well, the additional required power due to increased melting should be compensated.
@@ -309,8 +364,96 @@ const unsigned int dropsegments = 5; //everything with less than this number of
 #endif
 
 //The ASCII buffer for recieving from the serial:
+//Commands are packed one after the other into CMDQUEUE_SIZE bytes (2 bytes overhead each),
+//so short G1 lines fit 10 or more where 4 fixed slots of MAX_CMD_SIZE took the same RAM.
+//M1080 reports the peak and average number of queued commands.
 #define MAX_CMD_SIZE 96
-#define BUFSIZE 4
+#define CMDQUEUE_SIZE 384
+
+// Answer commands with "ok N<last line> P<free planner blocks> B<free command slots>" so a streaming
+// host can keep the queues full without waiting for every ok. B is counted with the average size
+// of the recent commands and only what cmdqueue_room() would hand out in one piece. Lines longer than
+// the average can still make it too high, so it is off until a host has been checked against it.
+//#define ADVANCED_OK
+
+// The serial receive interrupt looks for M108 (stop heat wait), M112 (kill) and M410 (quick stop)
+// and acts on them as they arrive, instead of after everything queued in front of them.
+#define EMERGENCY_PARSER
+
+// Bytes of serial output buffered and sent from the UDRE interrupt, power of 2 up to 256.
+// When it is full print() waits; M1080 reports how often that happened. 0 = send byte by byte.
+#define TX_BUFFER_SIZE 128
+
+// M1090 S1 switches the host port to binary frames once its ok is sent, about half the bytes of a
+// text G1 line and no N/checksum text to parse. A frame is 0xA5, seq, type, mask, one int32 (value*1000,
+// little endian) per mask bit (XYZEFSTP), CRC16/XMODEM of seq..values. Types: 0 G0, 1 G1, 2 G92, 3 M104,
+// 4 M140, 5 M106, 6 M107, 7 M109, 8 M190, 9 G28, 10 G90, 11 G91, 12 M82, 13 M83, 14 M400, 255 back to text.
+// Each frame is answered with ok, a bad frame with "Resend: <seq>".
+#define BINARY_PROTOCOL
+
+// M1100 <filename> uploads a file to SD as binary blocks instead of M28 text lines. After its ok the host sends
+// 0xB5, seq, length (little endian, up to 512), data, CRC16/XMODEM of seq..data (little endian), and may be
+// SD_UPLOAD_WINDOW blocks ahead of the "ok U<seq>" answers. A bad block gets "Resend: U<seq>" and the host
+// goes back to it, as it does when no answer comes within a second. A zero length block closes the file and
+// reports the KB/s. Takes 512 bytes of RAM.
+// Keep the window at 1 unless the host port has flow control: a block sent while the one before is written
+// to the card does not fit the 128 byte receive buffer and is lost.
+//#define SD_BINARY_UPLOAD
+#define SD_UPLOAD_WINDOW 1
+#define SD_UPLOAD_TIMEOUT 30 // seconds without a byte before the upload is given up
+
+// The print file is read through two 512 byte blocks of its own, filled with an open CMD18 multiple block
+// read, so FAT and directory access no longer throw its data out of the shared cache. Takes 1 KB of RAM.
+//#define SD_READ_AHEAD
+
+// 512 byte SD block cache slots (1, or 3 to 8; 1 when not set). With 3 or more, FAT and directory blocks
+// keep a slot each, file data and everything else take the least recently used of the rest, so seeks and
+// PLR writes stop throwing out each other's blocks. M1110 reports the hits and misses.
+//#define SD_CACHE_SLOTS 3
+
+// The file list keeps where every listed file of the current folder starts, so getfilename(n) reads from
+// there instead of from the top of the folder. With more files than entries every 2nd, 4th... one is kept
+// and the rest are read on from it. Built on the first listing after a card init, folder change or a file
+// being created or removed. 2 bytes of RAM per entry.
+#define SD_DIR_INDEX_SIZE 64
+
+// The screen file pages show the newest files first, by last write time, instead of the folder order
+// backwards. A pass over the folder keeps the SD_SORT_WINDOW newest files, paging past them makes another
+// pass for the next ones, so a page is a few entry reads. 2 bytes of RAM per window entry. Needs the index.
+#define SD_SORT_NEWEST_FIRST
+#define SD_SORT_WINDOW 30
+
+// Seeks in a file (print from height, power loss resume) find the cluster without following the FAT chain
+// from the start. One pass over the chain marks a file in one piece as contiguous, which is then also read
+// on without the FAT, or keeps the first SD_SEEK_RUNS runs of a fragmented one. 8 bytes of RAM per run.
+#define SD_SEEK_RUNS 8
+
+// A selected file is scanned once, while idle or waiting for heat, for the line and E position where each
+// layer starts. The table goes to a ZXXXXXXX.LYR file in the root and is reused until the file changes.
+// Print from height then jumps straight to its layer, and M27 reports the layer. About 80 bytes of RAM.
+#define SD_LAYER_INDEX
+
+// The layer scan also reads the slicer's print time, filament per extruder, layer count and size from its
+// comments (Cura, PrusaSlicer, Simplify3D), or works them out from the moves. They are kept in the layer
+// index file, M1130 reports them and the screen counts down the remaining time instead of up.
+#define SD_FILE_META
+
+// Read data is checked against the CRC the card sends with it, and commands and writes carry theirs. A block
+// with a bad CRC, read or rejected by the card, is tried again up to 3 times, each one SPI clock step slower,
+// instead of feeding garbage to the planner; after 1000 good blocks the clock steps back up. Other errors
+// fail at once. M1120 times a read of the card and reports the clock it is at, M21 restores the full one.
+#define SD_CHECK_AND_RETRY
+
+// Lines written by M28 and M928 are gathered into whole 512 byte blocks, which go to the card without the
+// cache's read of the block first. The file is synced every SD_WRITE_SYNC_MS instead of only at M29.
+// Uploads reserve SD_WRITE_RESERVE bytes of clusters in one run at a time, so the FAT is searched and
+// written once per run rather than once per cluster; what is not used is freed when the file is closed.
+// Borrows a block of SD_READ_AHEAD, takes 512 bytes of RAM of its own without it.
+//#define SD_WRITE_BUFFER
+#ifdef SD_WRITE_BUFFER
+#define SD_WRITE_SYNC_MS 5000
+#define SD_WRITE_RESERVE 1048576
+#endif
 
 // Firmware based and LCD controled retract
 // M207 and M208 can be used to define parameters for the retraction.
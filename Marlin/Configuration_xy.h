@@ -18,7 +18,12 @@
 
 // This determines the communication speed of the printer
 #define BAUDRATE 115200
-//#define BAUDRATE 115200
+//#define BAUDRATE 250000
+
+// When the host talks at another rate (framing errors, garbage bytes) the host port tries these
+// in turn after BAUDRATE, until a clean line comes in. 250000, 500000 and 1000000 have no error at 16MHz.
+// M1080 reports the rate in use and its error.
+#define BAUDRATE_AUTODETECT {250000, 500000, 1000000, 57600, 115200}
 
 //// The following define selects which electronics board you have. Please choose the one that matches your setup
 // 10 = Gen7 custom (Alfons3 Version) "https://github.com/Alfons3/Generation_7_Electronics"
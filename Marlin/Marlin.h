@@ -114,11 +114,7 @@ extern bool b_is_last_page;
 extern String file_name_list[6];
 extern String file_name_long_list[6];
 extern int iDWNPageID;
-void get_command_dwn();
-#endif
-
-#ifdef TL_TJC_CONTROLLER
-void get_command_1();
+bool get_command_dwn();
 #endif
 
 void get_command();
@@ -225,6 +221,11 @@ void get_coordinates(float XValue, float YValue, float ZValue, float EValue, int
 
 void prepare_move();
 void kill();
+void quick_stop_and_sync();
+extern volatile bool bHeatingStop;
+#ifdef EMERGENCY_PARSER
+extern volatile bool bQuickStopRequest;
+#endif
 void Stop();
 
 bool IsStopped();
@@ -237,6 +238,10 @@ void clamp_to_software_endstops(float target[3]);
 void command_G1(float XValue = -99999.0, float YValue = -99999.0, float ZValue = -99999.0, float EValue = -99999.0, int iMode = 0);
 
 void PrintStopOrFinished();
+#ifdef SD_LAYER_INDEX
+extern bool bLayerJump;
+void layer_jump_skip_queued();
+#endif
 void command_G4(float dwell = 0);
 void command_M81(bool Loop = true, bool ShowPage = true);
 
@@ -32,6 +32,10 @@
   ring_buffer rx_buffer  =  { { 0 }, 0, 0 };
 #endif
 
+#if TX_BUFFER_SIZE > 0 && UART_PRESENT(SERIAL_PORT)
+  tx_ring_buffer tx_buffer  =  { { 0 }, 0, 0 };
+#endif
+
 FORCE_INLINE void store_char(unsigned char c)
 {
   int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
@@ -47,30 +51,169 @@ FORCE_INLINE void store_char(unsigned char c)
 }
 
 
+#ifdef BAUDRATE_AUTODETECT
+volatile uint8_t rx_bad = 0;
+volatile uint8_t rx_lines = 0;
+volatile uint8_t rx_line = RX_LINE_BAD; // the first line may have started before the reset
+volatile bool rx_text = true;
+static const long baud_rates[] PROGMEM = BAUDRATE_AUTODETECT;
+#define BAUD_RATES (sizeof(baud_rates) / sizeof(baud_rates[0]))
+#endif
+
+#ifdef EMERGENCY_PARSER
+volatile bool emergency_parser_enabled = true;
+
+enum emergency_state_t
+{
+  EP_RESET, EP_N, EP_M, EP_M1, EP_M10, EP_M11, EP_M4, EP_M41,
+  EP_CODE, EP_ARMED, EP_IGNORE
+};
+static emergency_state_t emergency_state = EP_RESET;
+static uint16_t emergency_code; // 108, 112 or 410 once EP_CODE is reached
+
+// Called from the receive interrupts with every character. A line that is only
+// [N<nr>] M108/M112/M410 [*<checksum>] is acted on when its end of line arrives,
+// it is still queued as usual and ignored there.
+void emergency_parser(unsigned char c)
+{
+  if (c == '\n' || c == '\r') {
+    emergency_state_t s = emergency_state;
+    emergency_state = EP_RESET;
+    if (!emergency_parser_enabled || (s != EP_CODE && s != EP_ARMED))
+      return;
+    switch (emergency_code) {
+      case 108:
+        bHeatingStop = true;
+        break;
+      case 112:
+        kill();
+        break;
+      case 410:
+        bQuickStopRequest = true;
+        break;
+      default:
+        break;
+    }
+    return;
+  }
+
+  switch (emergency_state) {
+    case EP_RESET:
+      if (c == 'N')
+        emergency_state = EP_N;
+      else if (c == 'M')
+        emergency_state = EP_M;
+      else if (c != ' ')
+        emergency_state = EP_IGNORE;
+      break;
+    case EP_N:
+      if (c == 'M')
+        emergency_state = EP_M;
+      else if (!((c >= '0' && c <= '9') || c == ' ' || c == '-'))
+        emergency_state = EP_IGNORE;
+      break;
+    case EP_M:
+      emergency_state = c == '1' ? EP_M1 : c == '4' ? EP_M4 : EP_IGNORE;
+      break;
+    case EP_M1:
+      emergency_state = c == '0' ? EP_M10 : c == '1' ? EP_M11 : EP_IGNORE;
+      break;
+    case EP_M10:
+      emergency_code = 108;
+      emergency_state = c == '8' ? EP_CODE : EP_IGNORE;
+      break;
+    case EP_M11:
+      emergency_code = 112;
+      emergency_state = c == '2' ? EP_CODE : EP_IGNORE;
+      break;
+    case EP_M4:
+      emergency_state = c == '1' ? EP_M41 : EP_IGNORE;
+      break;
+    case EP_M41:
+      emergency_code = 410;
+      emergency_state = c == '0' ? EP_CODE : EP_IGNORE;
+      break;
+    case EP_CODE:
+      // M1080, M4101 are other commands, a space or the checksum may follow
+      emergency_state = (c >= '0' && c <= '9') ? EP_IGNORE : EP_ARMED;
+      break;
+    default:
+      break;
+  }
+}
+#endif //EMERGENCY_PARSER
+
 //#elif defined(SIG_USART_RECV)
 #if defined(M_USARTx_RX_vect)
   // fixed by Mark Sproul this is on the 644/644p
   //SIGNAL(SIG_USART_RECV)
   SIGNAL(M_USARTx_RX_vect)
   {
+#ifdef BAUDRATE_AUTODETECT
+    uint8_t status = M_UCSRxA; // the error flags belong to the byte still in UDR
+    unsigned char c  =  M_UDRx;
+    rx_check_char(status, c);
+#else
     unsigned char c  =  M_UDRx;
+#endif
+#ifdef EMERGENCY_PARSER
+    emergency_parser(c);
+#endif
     store_char(c);
   }
 #endif
 
+#if TX_BUFFER_SIZE > 0
+// Move the next byte of the tx buffer to the uart, switch the interrupt off when it is empty.
+// Only called when the data register is empty.
+FORCE_INLINE void tx_next_char()
+{
+  uint8_t t = tx_buffer.tail;
+  if (t != tx_buffer.head) {
+    M_UDRx = tx_buffer.buffer[t];
+    t = (t + 1) & (TX_BUFFER_SIZE - 1);
+    tx_buffer.tail = t;
+  }
+  if (t == tx_buffer.head)
+    cbi(M_UCSRxB, M_UDRIEx);
+}
+
+#if defined(M_USARTx_UDRE_vect)
+  ISR(M_USARTx_UDRE_vect)
+  {
+    tx_next_char();
+  }
+#endif
+#endif
+
 // Constructors ////////////////////////////////////////////////////////////////
 
 MarlinSerial::MarlinSerial()
 {
-
+  baud_requested = 0;
+  baud_actual = 0;
+  baud_u2x = false;
+#ifdef BAUDRATE_AUTODETECT
+  baud_locked = false;
+  baud_index = BAUD_RATES - 1; // the first switch goes to baud_rates[0]
+#endif
+#if TX_BUFFER_SIZE > 0
+  tx_overflows = 0;
+  tx_blocked_us = 0;
+#endif
 }
 
 // Public Methods //////////////////////////////////////////////////////////////
 
 void MarlinSerial::begin(long baud)
 {
-  uint16_t baud_setting;
-  bool useU2X = true;
+  // take the UBRR setting, normal or double speed, that comes closest to the rate.
+  // At 16MHz 250000, 500000 and 1000000 are exact, 115200 is 2.1% off with U2X.
+  uint16_t ubrr1 = (F_CPU / 8 + baud / 2) / baud - 1;   // U2X
+  uint16_t ubrr0 = (F_CPU / 16 + baud / 2) / baud - 1;  // normal
+  long baud1 = F_CPU / 8 / (ubrr1 + 1);
+  long baud0 = F_CPU / 16 / (ubrr0 + 1);
+  bool useU2X = labs(baud1 - baud) < labs(baud0 - baud);
 
 #if F_CPU == 16000000UL && SERIAL_PORT == 0
   // hardcoded exception for compatibility with the bootloader shipped
@@ -80,14 +223,19 @@ void MarlinSerial::begin(long baud)
     useU2X = false;
   }
 #endif
-  
+
+  uint16_t baud_setting;
   if (useU2X) {
     M_UCSRxA = 1 << M_U2Xx;
-    baud_setting = (F_CPU / 4 / baud - 1) / 2;
+    baud_setting = ubrr1;
+    baud_actual = baud1;
   } else {
     M_UCSRxA = 0;
-    baud_setting = (F_CPU / 8 / baud - 1) / 2;
+    baud_setting = ubrr0;
+    baud_actual = baud0;
   }
+  baud_requested = baud;
+  baud_u2x = useU2X;
 
   // assign the baud_setting, a.k.a. ubbr (USART Baud Rate Register)
   M_UBRRxH = baud_setting >> 8;
@@ -100,11 +248,96 @@ void MarlinSerial::begin(long baud)
 
 void MarlinSerial::end()
 {
+  flushTx();
   cbi(M_UCSRxB, M_RXENx);
   cbi(M_UCSRxB, M_TXENx);
   cbi(M_UCSRxB, M_RXCIEx);  
 }
 
+#ifdef BAUDRATE_AUTODETECT
+// Call from the main loop until a clean line came in, the rate is kept from then on.
+// Garbage before that means the host talks at another rate, go on to the next one in
+// BAUDRATE_AUTODETECT.
+void MarlinSerial::checkBaud(void)
+{
+  if (baud_locked)
+    return;
+  if (rx_lines > 0)
+    baud_locked = true;
+  else if (rx_bad >= 3) {
+    flushTx();
+    baud_index = (baud_index + 1) % BAUD_RATES;
+    begin(pgm_read_dword(&baud_rates[baud_index]));
+    CRITICAL_SECTION_START;
+    rx_bad = 0;
+    rx_line = RX_LINE_BAD;
+    rx_buffer.head = rx_buffer.tail;
+    CRITICAL_SECTION_END;
+  }
+}
+
+// Binary frames and file blocks say nothing about the rate, they are not counted
+void rx_check_text(bool on)
+{
+  CRITICAL_SECTION_START;
+  rx_text = on;
+  rx_bad = 0;
+  rx_line = RX_LINE_BAD;
+  CRITICAL_SECTION_END;
+}
+#endif
+
+#if TX_BUFFER_SIZE > 0
+void MarlinSerial::write(uint8_t c)
+{
+  // with interrupts off (kill, ISR) nothing would empty the buffer, send everything by polling
+  if (!(SREG & (1 << SREG_I))) {
+    flushTx();
+    while (!(M_UCSRxA & (1 << M_UDREx)))
+      ;
+    M_UDRx = c;
+    return;
+  }
+
+  // nothing queued and the uart is free, skip the buffer
+  if (tx_buffer.head == tx_buffer.tail && (M_UCSRxA & (1 << M_UDREx))) {
+    M_UDRx = c;
+    return;
+  }
+
+  uint8_t i = (tx_buffer.head + 1) & (TX_BUFFER_SIZE - 1);
+  if (i == tx_buffer.tail) {
+    // buffer full, wait for the interrupt to make room
+    tx_overflows++;
+    unsigned long us = micros();
+    while (i == tx_buffer.tail)
+      ;
+    tx_blocked_us += micros() - us;
+  }
+
+  tx_buffer.buffer[tx_buffer.head] = c;
+  CRITICAL_SECTION_START;
+  tx_buffer.head = i;
+  sbi(M_UCSRxB, M_UDRIEx);
+  CRITICAL_SECTION_END;
+}
+
+// Wait until everything in the tx buffer has been handed to the uart
+void MarlinSerial::flushTx(void)
+{
+  if (SREG & (1 << SREG_I)) {
+    while (tx_buffer.head != tx_buffer.tail)
+      ;
+  } else {
+    while (tx_buffer.head != tx_buffer.tail) {
+      while (!(M_UCSRxA & (1 << M_UDREx)))
+        ;
+      tx_next_char();
+    }
+  }
+}
+#endif
+
 
 
 int MarlinSerial::peek(void)
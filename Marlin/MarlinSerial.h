@@ -55,6 +55,9 @@
 #define M_RXCx SERIAL_REGNAME(RXC,SERIAL_PORT,)
 #define M_USARTx_RX_vect SERIAL_REGNAME(USART,SERIAL_PORT,_RX_vect)
 #define M_U2Xx SERIAL_REGNAME(U2X,SERIAL_PORT,)
+#define M_UDRIEx SERIAL_REGNAME(UDRIE,SERIAL_PORT,)
+#define M_FEx SERIAL_REGNAME(FE,SERIAL_PORT,)
+#define M_USARTx_UDRE_vect SERIAL_REGNAME(USART,SERIAL_PORT,_UDRE_vect)
 
 
 
@@ -84,6 +87,65 @@ struct ring_buffer
   extern ring_buffer rx_buffer;
 #endif
 
+// Transmit ring buffer, emptied by the UDRE interrupt so print() does not wait for the uart.
+// TX_BUFFER_SIZE must be a power of 2 up to 256, 0 writes straight to the uart as before.
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 0
+#endif
+
+#ifdef BAUDRATE_AUTODETECT
+#define RX_LINE_START 0 // nothing since the last line end
+#define RX_LINE_TEXT 1  // only text since then
+#define RX_LINE_BAD 2   // a bad byte since then
+extern volatile uint8_t rx_bad;   // framing errors and bytes a host does not send in text mode
+extern volatile uint8_t rx_lines; // clean lines received, text and no bad byte
+extern volatile uint8_t rx_line;  // RX_LINE_* of the line coming in
+extern volatile bool rx_text;     // off while the host sends binary frames or file blocks
+
+FORCE_INLINE void rx_check_char(uint8_t status, unsigned char c)
+{
+  if (!rx_text)
+    return;
+  if ((status & (1 << M_FEx)) || c >= 0x80 || (c < ' ' && c != '\n' && c != '\r' && c != '\t')) {
+    if (rx_bad < 255)
+      rx_bad++;
+    rx_line = RX_LINE_BAD;
+  }
+  else if (c == '\n') {
+    if (rx_line == RX_LINE_TEXT && rx_lines < 255)
+      rx_lines++;
+    rx_line = RX_LINE_START;
+  }
+  else if (rx_line == RX_LINE_START && c != '\r')
+    rx_line = RX_LINE_TEXT;
+}
+
+void rx_check_text(bool on);
+#endif
+
+#ifdef EMERGENCY_PARSER
+// Watches the received characters for M108, M112 and M410 lines and acts on them at once
+extern volatile bool emergency_parser_enabled;
+void emergency_parser(unsigned char c);
+#endif
+
+#if TX_BUFFER_SIZE > 0
+#if TX_BUFFER_SIZE > 256 || (TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1))
+#error TX_BUFFER_SIZE must be a power of 2 up to 256
+#endif
+
+struct tx_ring_buffer
+{
+  unsigned char buffer[TX_BUFFER_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+};
+
+#if UART_PRESENT(SERIAL_PORT)
+  extern tx_ring_buffer tx_buffer;
+#endif
+#endif
+
 class MarlinSerial //: public Stream
 {
 
@@ -91,6 +153,18 @@ class MarlinSerial //: public Stream
     MarlinSerial();
     void begin(long);
     void end();
+
+    long baud_requested; // rate asked for in begin()
+    long baud_actual;    // rate the UBRR setting really gives
+    bool baud_u2x;
+
+#ifdef BAUDRATE_AUTODETECT
+    bool baud_locked;    // a clean line came in at this rate
+    void checkBaud(void);
+  private:
+    uint8_t baud_index;
+  public:
+#endif
     int peek(void);
     int read(void);
     void flush(void);
@@ -100,6 +174,13 @@ class MarlinSerial //: public Stream
       return (unsigned int)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
     }
     
+#if TX_BUFFER_SIZE > 0
+    void write(uint8_t c);
+    void flushTx(void);
+
+    unsigned long tx_overflows;  // writes that found the tx buffer full and had to wait
+    unsigned long tx_blocked_us; // time spent waiting for room in the tx buffer
+#else
     FORCE_INLINE void write(uint8_t c)
     {
       while (!((M_UCSRxA) & (1 << M_UDREx)))
@@ -107,12 +188,22 @@ class MarlinSerial //: public Stream
 
       M_UDRx = c;
     }
+
+    FORCE_INLINE void flushTx(void) {}
+#endif
     
     
     FORCE_INLINE void checkRx(void)
     {
-      if((M_UCSRxA & (1<<M_RXCx)) != 0) {
+      uint8_t status = M_UCSRxA;
+      if((status & (1<<M_RXCx)) != 0) {
         unsigned char c  =  M_UDRx;
+#ifdef BAUDRATE_AUTODETECT
+        rx_check_char(status, c);
+#endif
+#ifdef EMERGENCY_PARSER
+        emergency_parser(c);
+#endif
         int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
 
         // if we should be storing the received character into the location
@@ -37,6 +37,10 @@
 #include "cardreader.h"
 #include "ConfigurationStore.h"
 #include "language.h"
+#include "parse_number.h"
+#if defined(BINARY_PROTOCOL) || defined(SD_BINARY_UPLOAD)
+#include <util/crc16.h>
+#endif
 //#include "pins_arduino.h"
 
 #if NUM_SERVOS > 0
@@ -99,8 +103,10 @@
 // M105 - Read current temp
 // M106 - Fan on
 // M107 - Fan off
+// M108 - Stop waiting for heaters (M109/M190), needs EMERGENCY_PARSER to be seen during the wait
 // M109 - Sxxx Wait for extruder current temp to rG1each target temp. Waits only when heating
 //        Rxxx Wait for extruder current temp to reach target temp. Waits when heating and cooling
+// M112 - Emergency stop: kill heaters and steppers, needs a reset
 // M114 - Output current position to serial port
 // M115 - Capabilities string
 // M117 - display message
@@ -110,6 +116,7 @@
 // M128 - EtoP Open (BariCUDA EtoP = electricity to air pressure transducer by jmil)
 // M129 - EtoP Closed (BariCUDA EtoP = electricity to air pressure transducer by jmil)
 // M140 - Set bed target temp
+// M155 - S<seconds> auto report temperatures every S seconds from the main loop, S0 to stop
 // M190 - Sxxx Wait for bed current temp to reach target temp. Waits only when heating
 //        Rxxx Wait for bed current temp to reach target temp. Waits when heating and cooling
 // M200 - Set filament diameter
@@ -133,7 +140,9 @@
 // M302 - Allow cold extrudes, or set the minimum extrude S<temperature>.
 // M303 - PID relay autotune S<temperature> sets the target temperature. (default target temperature = 150C)
 // M304 - Set bed PID parameters P I and D
+// M310 - Thermal model protection: E<heater, -1 bed> G<gain degC/pwm> C<time constant s> R<tolerance degC> N<count> S<0|1 enable>
 // M400 - Finish all moves
+// M410 - Quick stop: drop all planned moves at once, the position is taken from the steppers
 // M500 - stores paramters in EEPROM
 // M501 - reads parameters from EEPROM (if you need reset them after you changed them temporarily).
 // M502 - reverts to the default "factory settings".  You still need to store them in EEPROM afterwards if you want to.
@@ -148,6 +157,12 @@
 // M928 - Start SD logging (M928 filename.g) - ended by M29
 // M999 - Restart after being stopped by error
 // M1001 - Set & Get LanguageID
+// M1060 - Heater telemetry: dump as CSV, F1 to SD file, I<ms> sample interval, C clear
+// M1070 - Heat nozzle H<temp> and bed B<temp> at the same time and wait for both, L<0|1> M190/M109 lookahead
+// M1080 - Command queue depth, baud rate error and serial statistics, R resets the counters
+// M1090 - S1 switch the host port to binary frames (see get_binary_command), S0 back to text
+// M1100 - Binary upload to SD (M1100 filename.g), blocks as in get_upload_block
+// M1110 - SD block cache hits and misses for FAT, directory and file data blocks, R resets them
 //
 
 //Stepper Movement Variables
@@ -222,17 +237,35 @@ static long gcode_N, gcode_LastN, Stopped_gcode_LastN = 0;
 
 static bool relative_mode = false; //Determines Absolute or Relative Coordinates
 
-static char cmdbuffer[BUFSIZE][MAX_CMD_SIZE];
-static bool fromsd[BUFSIZE];
-static int bufindr = 0;
-static int bufindw = 0;
-static int buflen = 0;
+//Commands are packed back to back in one ring: [length | CMD_FROM_SD][text]\0
+//A line is assembled in place at bufindw, which always has room for MAX_CMD_SIZE before it starts.
+#define CMD_FROM_SD 0x80
+//The host, SD and screen readers stop while less than two lines of MAX_CMD_SIZE fit, so enquecommand()
+//from the screen handlers and the rest of the firmware finds room for one even during an SD print.
+#define CMD_READER_ROOM (2 * (MAX_CMD_SIZE + 1))
+#if CMDQUEUE_SIZE < 3 * (MAX_CMD_SIZE + 1)
+#error CMDQUEUE_SIZE must fit 3 lines of MAX_CMD_SIZE
+#endif
+static char cmdqueue[CMDQUEUE_SIZE];
+static int bufindr = 0;                  // offset of the oldest command
+static int bufindw = 0;                  // offset of the command being assembled
+static int buflen = 0;                   // commands in the queue
+static int cmdqueue_end = CMDQUEUE_SIZE; // the reader goes back to 0 here when the writer wrapped early
+static uint8_t cmdqueue_peak = 0;
+static unsigned long cmdqueue_depth_sum = 0;
+static unsigned long cmdqueue_depth_count = 0;
+static uint8_t cmdqueue_size_avg = 32; // running average of the bytes a command takes
 //static int i = 0;
-static char serial_char;
-static int serial_count = 0;
-static boolean comment_mode = false;
+static int serial_count = 0; // chars of the half line at cmd_writing(), it belongs to cmd_owner
 static char *strchr_pointer; // just a pointer to find chars in the cmd string like X, Y, Z, E, etc
 
+struct command_tokens
+{
+    const char *line;
+    uint8_t pos[27]; // 'A'..'Z' then '*': offset of the first one in line + 1, 0 = not in line
+};
+static command_tokens cmd_tokens; // the command at bufindr, set by process_commands
+
 const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 
 //static float tt = 0;
@@ -267,6 +300,11 @@ Servo servos[NUM_SERVOS];
 int iPLDetected = 0;
 #endif
 
+#ifdef AUTO_REPORT_TEMPERATURES
+static uint8_t iAutoReportSeconds = 0; // M155, 0 = off
+static unsigned long lNextTempReport = 0;
+#endif
+
 bool CooldownNoWait = true;
 bool target_direction;
 void (*resetFunc)(void) = 0; // Declare reset function as address 0
@@ -327,39 +365,277 @@ extern "C"
     }
 }
 
+FORCE_INLINE char *cmd_current()
+{
+    return &cmdqueue[bufindr + 1];
+}
+
+FORCE_INLINE char *cmd_writing()
+{
+    return &cmdqueue[bufindw + 1];
+}
+
+//Bytes the command at pos takes in the ring
+FORCE_INLINE uint8_t cmd_size(int pos)
+{
+    return ((uint8_t)cmdqueue[pos] & ~CMD_FROM_SD) + 2;
+}
+
+FORCE_INLINE bool cmd_fromsd()
+{
+    return (cmdqueue[bufindr] & CMD_FROM_SD) != 0;
+}
+
+//Offset of the command after the one at pos
+static int cmdqueue_next(int pos)
+{
+    pos += cmd_size(pos);
+    if (pos >= cmdqueue_end)
+        pos = 0;
+    return pos;
+}
+
+//True when need bytes are free in one piece at bufindw. Moves bufindw to the start of the ring
+//if the end is too short and no line is half assembled there.
+static bool cmdqueue_room(int need)
+{
+    if (buflen == 0 && serial_count == 0)
+    {
+        bufindr = bufindw = 0;
+        cmdqueue_end = CMDQUEUE_SIZE;
+    }
+    int limit = (bufindw > bufindr || buflen == 0) ? CMDQUEUE_SIZE : bufindr;
+    if (bufindw + need <= limit)
+        return true;
+    if (limit == CMDQUEUE_SIZE && serial_count == 0 && need <= bufindr)
+    {
+        cmdqueue_end = bufindw;
+        bufindw = 0;
+        return true;
+    }
+    return false;
+}
+
+//Queue the terminated line at cmd_writing()
+static void cmdqueue_push(bool sd)
+{
+    uint8_t len = strlen(cmd_writing());
+    cmdqueue[bufindw] = len | (sd ? CMD_FROM_SD : 0);
+    bufindw += len + 2;
+    buflen++;
+    cmdqueue_size_avg = ((uint16_t)cmdqueue_size_avg * 7 + len + 2) / 8;
+    if (buflen > cmdqueue_peak)
+        cmdqueue_peak = buflen;
+}
+
+//Drop the command at bufindr once it is done
+static void cmdqueue_pop()
+{
+    cmdqueue_depth_sum += buflen;
+    cmdqueue_depth_count++;
+    bufindr += cmd_size(bufindr);
+    buflen--;
+    if (bufindr >= cmdqueue_end)
+    {
+        bufindr = 0;
+        cmdqueue_end = CMDQUEUE_SIZE;
+    }
+}
+
+#ifdef ADVANCED_OK
+//Lines of the average size get_command() can still take, once the command being processed is done if popping.
+//Counted the way cmdqueue_room() hands out space: a line is only started with CMD_READER_ROOM bytes
+//free in one piece, and what is left at the end of the ring when the writer wraps is lost.
+static int cmdqueue_lines_free(bool popping)
+{
+    int tail, head = 0;
+    int r = -1; // oldest command left then
+    if (!popping && buflen > 0)
+        r = bufindr;
+    else if (popping && buflen > 1)
+        r = cmdqueue_next(bufindr);
+    if (r < 0)
+        tail = serial_count ? CMDQUEUE_SIZE - bufindw : CMDQUEUE_SIZE;
+    else if (bufindw > r)
+    {
+        tail = CMDQUEUE_SIZE - bufindw;
+        head = r;
+    }
+    else
+        tail = r - bufindw;
+    tail -= serial_count;
+    int lines = 0;
+    if (tail > CMD_READER_ROOM)
+        lines += (tail - CMD_READER_ROOM) / cmdqueue_size_avg;
+    if (head > CMD_READER_ROOM)
+        lines += (head - CMD_READER_ROOM) / cmdqueue_size_avg;
+    return lines;
+}
+#endif
+
+//ok for a host line, popping when it goes out for the command at bufindr
+static void send_ok(bool popping)
+{
+#ifdef ADVANCED_OK
+    // ok N<last line> P<free planner blocks> B<free command slots>
+    SERIAL_PROTOCOLPGM(MSG_OK);
+    SERIAL_PROTOCOLPGM(" N");
+    SERIAL_PROTOCOL(gcode_LastN);
+    SERIAL_PROTOCOLPGM(" P");
+    SERIAL_PROTOCOL((int)(BLOCK_BUFFER_SIZE - 1 - movesplanned()));
+    SERIAL_PROTOCOLPGM(" B");
+    SERIAL_PROTOCOLLN(cmdqueue_lines_free(popping));
+#else
+    SERIAL_PROTOCOLLNPGM(MSG_OK);
+#endif
+}
+
+#ifdef EMERGENCY_PARSER
+//A host line the receive interrupt has already acted on: [N<nr>] M108/M112/M410, the same match
+//as emergency_parser(). It is answered but not queued, a queued M410 would also drop the moves
+//sent after it.
+static bool emergency_line(const char *p)
+{
+    if (!emergency_parser_enabled)
+        return false;
+    while (*p == ' ')
+        p++;
+    if (*p == 'N')
+    {
+        while (*++p != 'M')
+            if (!((*p >= '0' && *p <= '9') || *p == ' ' || *p == '-'))
+                return false;
+    }
+    if (*p++ != 'M')
+        return false;
+    if (strncmp_P(p, PSTR("108"), 3) && strncmp_P(p, PSTR("112"), 3) && strncmp_P(p, PSTR("410"), 3))
+        return false;
+    return !(p[3] >= '0' && p[3] <= '9');
+}
+#endif
+
+#ifdef SD_LAYER_INDEX
+bool bLayerJump = false;       // plan_buffer_line() moved the print file to a layer
+static int sd_skip_queued = 0; // SD commands read before that, they are dropped unrun
+
+//The print file jumped to a layer, the SD commands queued behind the current one are from before it
+void layer_jump_skip_queued()
+{
+    bLayerJump = true;
+    sd_skip_queued = 0;
+    int pos = bufindr;
+    for (int i = 1; i < buflen; i++)
+    {
+        pos = cmdqueue_next(pos);
+        if (cmdqueue[pos] & CMD_FROM_SD)
+            sd_skip_queued++;
+    }
+}
+
+//After the command that jumped: the file goes on at the line starting the layer, the nozzle is at its height
+static void layer_jump_done()
+{
+    bLayerJump = false;
+    current_position[X_AXIS] = destination[X_AXIS] = 0.0;
+    current_position[Y_AXIS] = destination[Y_AXIS] = 0.0;
+    current_position[Z_AXIS] = destination[Z_AXIS] = card.layerJumpZ;
+    current_position[E_AXIS] = destination[E_AXIS] = card.layerJumpE;
+    plan_set_position(0.0, 0.0, card.layerJumpZ, card.layerJumpE);
+    PrintFromZHeightFound = true;
+    fanSpeed = 255;
+}
+#endif
+
+//Minutes to show for a print running for time minutes: what is left of the file's estimate when it has one
+static uint16_t print_minutes(uint16_t time)
+{
+#ifdef SD_FILE_META
+    uint16_t estimate = card.meta.seconds / 60;
+    if (estimate)
+        return estimate > time ? estimate - time : 0;
+#endif
+    return time;
+}
+
 //adds an command to the main command buffer
-//thats really done in a non-safe way.
-//needs overworking someday
-void enquecommand(const char *cmd)
+//a line that get_command is assembling at the same time is moved behind it
+static void enquecommand_copy(const char *cmd, bool pgm)
 {
-    if (buflen < BUFSIZE)
+    int len = pgm ? strlen_P(cmd) : strlen(cmd);
+    if (len > MAX_CMD_SIZE - 1)
+        len = MAX_CMD_SIZE - 1;
+    if (!cmdqueue_room(len + 2 + (serial_count > 0 ? MAX_CMD_SIZE + 1 : 0)))
     {
-        //this is dangerous if a mixing of serial and this happsens //Why?
-        strcpy(&(cmdbuffer[bufindw][0]), cmd);
-        SERIAL_ECHO_START;
-        SERIAL_ECHOPGM("enqueing \"");
-        SERIAL_ECHO(cmdbuffer[bufindw]);
-        SERIAL_ECHOLNPGM("\"");
-        bufindw = (bufindw + 1) % BUFSIZE;
-        buflen += 1;
+        SERIAL_ERROR_START;
+        SERIAL_ERRORPGM("Command queue full, dropped \"");
+        if (pgm)
+            serialprintPGM(cmd);
+        else
+            SERIAL_ERROR(cmd);
+        SERIAL_ERRORLNPGM("\"");
+        return;
     }
+    if (serial_count > 0)
+        memmove(cmd_writing() + len + 2, cmd_writing(), serial_count);
+    if (pgm)
+        strncpy_P(cmd_writing(), cmd, len);
+    else
+        strncpy(cmd_writing(), cmd, len);
+    cmd_writing()[len] = 0;
+    SERIAL_ECHO_START;
+    SERIAL_ECHOPGM("enqueing \"");
+    SERIAL_ECHO(cmd_writing());
+    SERIAL_ECHOLNPGM("\"");
+    cmdqueue_push(false);
+}
+
+void enquecommand(const char *cmd)
+{
+    enquecommand_copy(cmd, false);
 }
 
 void enquecommand_P(const char *cmd)
 {
-    if (buflen < BUFSIZE)
-    {
-        //this is dangerous if a mixing of serial and this happsens
-        strcpy_P(&(cmdbuffer[bufindw][0]), cmd);
-        SERIAL_ECHO_START;
-        SERIAL_ECHOPGM("enqueing \"");
-        SERIAL_ECHO(cmdbuffer[bufindw]);
-        SERIAL_ECHOLNPGM("\"");
-        bufindw = (bufindw + 1) % BUFSIZE;
-        buflen += 1;
+    enquecommand_copy(cmd, true);
+}
+
+//Split a command line in one pass: remembers where each letter A..Z and the '*' first appears,
+//so code_seen() is a table lookup instead of a strchr over the whole line for every parameter.
+static void tokenize_command(command_tokens &t, const char *line)
+{
+    memset(t.pos, 0, sizeof(t.pos));
+    t.line = line;
+    for (uint8_t i = 0; line[i] != 0 && i < 255; i++)
+    {
+        uint8_t k;
+        if (line[i] >= 'A' && line[i] <= 'Z')
+            k = line[i] - 'A';
+        else if (line[i] == '*')
+            k = 26;
+        else
+            continue;
+        if (t.pos[k] == 0)
+            t.pos[k] = i + 1;
     }
 }
 
+//Pointer to the first code in the tokenized line, NULL if it is not there
+static char *token_pointer(const command_tokens &t, char code)
+{
+    if (t.line == NULL)
+        return NULL;
+    uint8_t k;
+    if (code >= 'A' && code <= 'Z')
+        k = code - 'A';
+    else if (code == '*')
+        k = 26;
+    else
+        return strchr(t.line, code);
+    if (t.pos[k] == 0 || t.line[t.pos[k] - 1] != code) // not there, or the line was overwritten since
+        return NULL;
+    return (char *)t.line + t.pos[k] - 1;
+}
+
 void setup_killpin()
 {
 #if defined(POWER_LOSS_DETECT_PIN) && POWER_LOSS_DETECT_PIN > -1
@@ -563,7 +839,10 @@ bool b_PLR_MODULE_Detected = false;
 int iMoveRate = 100;
 bool bInited = false;
 int iDWNPageID = 0;
-bool bHeatingStop = false;
+volatile bool bHeatingStop = false; // M108 or the screen stop button ends M109/M190
+#ifdef EMERGENCY_PARSER
+volatile bool bQuickStopRequest = false; // M410 seen by the serial receive interrupt
+#endif
 
 bool bAtvGot0 = false;
 bool bAtvGot1 = false;
@@ -578,16 +857,44 @@ long lVcc = 0;
 String gsM117 = "";
 String gsPrinting = "";
 
-void get_command_dwn()
+//DWIN frames are 5A A5, length, then that many bytes. Bytes are taken as they arrive instead of
+//waiting for the rest; the header only goes into dwn_command once the frame is whole and
+//process_command_dwn clears it again, so no new frame is read over one not yet handled.
+static int dwn_count = 0;
+static unsigned long dwn_last_ms = 0;
+
+bool get_command_dwn()
 {
-    //int dwn_command[255] = {0};     //Clear command
-    int i = 0;
-    while (MSerial2_available() > 0)
+    while (dwn_command[0] != 0x5A && MSerial2_available() > 0)
     {
-        dwn_command[i] = MSerial2_read();
-        i++;
-        delay(2);
+        uint8_t c = MSerial2_read();
+        if (dwn_count > 0 && millis() - dwn_last_ms > 100)
+            dwn_count = 0; // rest of the frame never came
+        dwn_last_ms = millis();
+        if (dwn_count == 0 && c != 0x5A)
+            continue;
+        if (dwn_count == 1 && c != 0xA5)
+        {
+            dwn_count = (c == 0x5A);
+            continue;
+        }
+        if (dwn_count >= 255)
+        {
+            dwn_count = 0;
+            continue;
+        }
+        if (dwn_count >= 2)
+            dwn_command[dwn_count] = c;
+        dwn_count++;
+        if (dwn_count > 2 && dwn_count == dwn_command[2] + 3)
+        {
+            dwn_count = 0;
+            dwn_command[0] = 0x5A;
+            dwn_command[1] = 0xA5;
+            return true;
+        }
     }
+    return false;
 }
 
 long ConvertHexLong(long command[], int Len)
@@ -1062,7 +1369,7 @@ void tenlog_screen_update()
     int iPercent = 0;
     if (card.sdprinting == 1)
     {
-        uint16_t time = millis() / 60000 - starttime / 60000;
+        uint16_t time = print_minutes(millis() / 60000 - starttime / 60000);
         sTime = String(itostr2(time / 60)) + " :" + String(itostr2(time % 60));
         iPercent = card.percentDone();
         DWN_Data(0x6051, iPercent, 2);
@@ -1723,7 +2030,7 @@ void tenlog_screen_update()
     //lN=dual_x_carriage_mode;                //17 time
     if (IS_SD_PRINTING)
     {
-        uint16_t time = millis() / 60000 - starttime / 60000;
+        uint16_t time = print_minutes(millis() / 60000 - starttime / 60000);
         sSend = String(itostr2(time / 60)) + ":" + String(itostr2(time % 60));
         strAll = strAll + sSend + "|";
     }
@@ -2065,11 +2372,6 @@ void setup()
     SERIAL_ECHO(freeMemory());
     SERIAL_ECHOPGM(MSG_PLANNER_BUFFER_BYTES);
     SERIAL_ECHOLN((int)sizeof(block_t) * BLOCK_BUFFER_SIZE);
-    for (int8_t i = 0; i < BUFSIZE; i++)
-    {
-        fromsd[i] = false;
-    }
-
     // loads data from EEPROM if available else uses defaults (and resets step acceleration rate)
     Config_RetrieveSettings();
     duplicate_extruder_x_offset = (tl_X2_MAX_POS - X_NOZZLE_WIDTH) / 2.0;
@@ -2175,34 +2477,63 @@ void setup()
     WRITE(PS_ON_PIN, PS_ON_AWAKE);
 }
 
+#if defined(TEMP_0_PIN) && TEMP_0_PIN > -1
+// " T:210.0/210.0 T1:... B:60.0 /60.0 @:64 B@:127" and the line end, used by M105 and M155
+void print_heaterstates(int iE)
+{
+    SERIAL_PROTOCOLPGM(" T:");
+    SERIAL_PROTOCOL_F(degHotend(0), 1);
+    SERIAL_PROTOCOLPGM("/");
+    SERIAL_PROTOCOL_F(degTargetHotend(0), 1);
+#if defined(TEMP_1_PIN) && TEMP_1_PIN > -1
+    SERIAL_PROTOCOLPGM(" T1:");
+    SERIAL_PROTOCOL_F(degHotend(1), 1);
+    SERIAL_PROTOCOLPGM("/");
+    SERIAL_PROTOCOL_F(degTargetHotend(1), 1);
+#endif
+#if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+    SERIAL_PROTOCOLPGM(" B:");
+    SERIAL_PROTOCOL_F(degBed(), 1);
+    SERIAL_PROTOCOLPGM(" /");
+    SERIAL_PROTOCOL_F(degTargetBed(), 1);
+#endif //TEMP_BED_PIN
+    SERIAL_PROTOCOLPGM(" @:");
+    SERIAL_PROTOCOL(getHeaterPower(iE));
+    SERIAL_PROTOCOLPGM(" B@:");
+    SERIAL_PROTOCOL(getHeaterPower(-1));
+    SERIAL_PROTOCOLLN("");
+}
+#endif
+
 void loop()
 {
 
-#ifdef TL_TJC_CONTROLLER
-    if (buflen < (BUFSIZE - 1))
-        get_command_1();
-#endif
 #ifdef TL_DWN_CONTROLLER
-    get_command_dwn();
-    process_command_dwn();
     if (!bAtv)
         chkAtv();
 #endif
 
-    if (buflen < (BUFSIZE - 1))
-        get_command();
+#if defined(BAUDRATE_AUTODETECT) && !defined(AT90USB)
+    MYSERIAL.checkBaud();
+#endif
+    get_command();
 
 #ifdef SDSUPPORT
     card.checkautostart(false);
 #endif
     if (buflen)
     {
+#ifdef SD_LAYER_INDEX
+        if (sd_skip_queued > 0 && cmd_fromsd())
+            sd_skip_queued--;
+        else
+#endif
 #ifdef SDSUPPORT
         if (card.saving)
         {
-            if (strstr_P(cmdbuffer[bufindr], PSTR("M29")) == NULL)
+            if (strstr_P(cmd_current(), PSTR("M29")) == NULL)
             {
-                card.write_command(cmdbuffer[bufindr]);
+                card.write_command(cmd_current());
                 if (card.logging)
                 {
                     process_commands();
@@ -2233,8 +2564,11 @@ void loop()
 #else
         process_commands();
 #endif //SDSUPPORT
-        buflen = (buflen - 1);
-        bufindr = (bufindr + 1) % BUFSIZE;
+#ifdef SD_LAYER_INDEX
+        if (bLayerJump)
+            layer_jump_done();
+#endif
+        cmdqueue_pop();
     }
 
 #ifdef POWER_LOSS_TRIGGER_BY_PIN
@@ -2249,6 +2583,14 @@ void loop()
         card.sdprinting = 0;
     }
 
+#if defined(AUTO_REPORT_TEMPERATURES) && defined(TEMP_0_PIN) && TEMP_0_PIN > -1
+    if (iAutoReportSeconds && (long)(millis() - lNextTempReport) >= 0)
+    {
+        lNextTempReport = millis() + iAutoReportSeconds * 1000UL;
+        print_heaterstates(active_extruder);
+    }
+#endif
+
 #ifdef FILAMENT_FAIL_DETECT
     //check_filament_fail();
 #endif
@@ -2261,150 +2603,19 @@ void loop()
     CheckTempError();
 }
 
-#ifdef TL_TJC_CONTROLLER
-
-void get_command_1()
-{
-    while (MSerial2_available() > 0 && buflen < BUFSIZE)
-    {
-
-        serial_char = MSerial2_read();
-        int iSC = (int)serial_char;
-
-        if (serial_char == '\n' ||
-            iSC == -1 ||
-            serial_char == '\r' ||
-            (serial_char == ':' && comment_mode == false) ||
-            serial_count >= (MAX_CMD_SIZE - 1))
-        {
-            if (!serial_count)
-            {                         //if empty line
-                comment_mode = false; //for new command
-                return;
-            }
-            cmdbuffer[bufindw][serial_count] = 0; //terminate string
-            if (!comment_mode)
-            {
-                comment_mode = false; //for new command
-                fromsd[bufindw] = false;
-                if (strchr(cmdbuffer[bufindw], 'N') != NULL)
-                {
-                    strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
-                    gcode_N = (strtol(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL, 10));
-                    if (gcode_N != gcode_LastN + 1 && (strstr_P(cmdbuffer[bufindw], PSTR("M110")) == NULL))
-                    {
-                        SERIAL_ERROR_START;
-                        SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
-                        SERIAL_ERRORLN(gcode_LastN);
-                        //Serial.println(gcode_N);
-                        FlushSerialRequestResend();
-                        serial_count = 0;
-                        return;
-                    }
-
-                    if (strchr(cmdbuffer[bufindw], '*') != NULL)
-                    {
-                        byte checksum = 0;
-                        byte count = 0;
-                        while (cmdbuffer[bufindw][count] != '*')
-                            checksum = checksum ^ cmdbuffer[bufindw][count++];
-                        strchr_pointer = strchr(cmdbuffer[bufindw], '*');
-
-                        if ((int)(strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)) != checksum)
-                        {
-                            SERIAL_ERROR_START;
-                            SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
-                            SERIAL_ERRORLN(gcode_LastN);
-                            FlushSerialRequestResend();
-                            serial_count = 0;
-                            return;
-                        }
-                        //if no errors, continue parsing
-                    }
-                    else
-                    {
-                        SERIAL_ERROR_START;
-                        SERIAL_ERRORPGM(MSG_ERR_NO_CHECKSUM);
-                        SERIAL_ERRORLN(gcode_LastN);
-                        FlushSerialRequestResend();
-                        serial_count = 0;
-                        return;
-                    }
-
-                    gcode_LastN = gcode_N;
-                    //if no errors, continue parsing
-                }
-                else // if we don't receive 'N' but still see '*'
-                {
-                    if ((strchr(cmdbuffer[bufindw], '*') != NULL))
-                    {
-                        SERIAL_ERROR_START;
-                        SERIAL_ERRORPGM(MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM);
-                        SERIAL_ERRORLN(gcode_LastN);
-                        serial_count = 0;
-                        return;
-                    }
-                }
-                if ((strchr(cmdbuffer[bufindw], 'G') != NULL))
-                {
-                    strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-                    switch ((int)((strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL))))
-                    {
-                    case 0:
-                    case 1:
-                    case 2:
-                    case 3:
-                        if (Stopped == false)
-                        { // If printer is stopped by an error the G[0-3] codes are ignored.
-#ifdef SDSUPPORT
-                            if (card.saving)
-                                break;
-#endif //SDSUPPORT \
-    //SERIAL_PROTOCOLLNPGM(MSG_OK);
-                        }
-                        else
-                        {
-                            SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
-                            //LCD_MESSAGEPGM(MSG_STOPPED);
-                        }
-                        break;
-                    default:
-                        break;
-                    }
-                }
-                bufindw = (bufindw + 1) % BUFSIZE;
-                buflen += 1;
-            }
-            serial_count = 0; //clear buffer
-        }
-        else
-        {
-            if (serial_char == ';' ||
-                (int)serial_char < 0 ||
-                ((int)serial_char == 104 && cmdbuffer[bufindw][0] != 'M'))
-            {
-                comment_mode = true;
-            }
-            if (!comment_mode)
-                cmdbuffer[bufindw][serial_count++] = serial_char;
-        }
-    }
-}
-#endif
-
 float code_value()
 {
-    return (strtod(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL));
+    return parse_float(strchr_pointer + 1);
 }
 
 long code_value_long()
 {
-    return (strtol(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL, 10));
+    return parse_long(strchr_pointer + 1);
 }
 
 bool code_seen(char code)
 {
-    strchr_pointer = strchr(cmdbuffer[bufindr], code);
+    strchr_pointer = token_pointer(cmd_tokens, code);
     return (strchr_pointer != NULL); //Return True if a character was found
 }
 
@@ -2470,221 +2681,671 @@ void command_G4(float dwell = 0)
     }
 }
 
-void get_command()
+#if defined(BINARY_PROTOCOL) || defined(SD_BINARY_UPLOAD)
+//Text on the host port, off while it carries binary frames or file blocks
+static void host_text(bool on)
 {
-    while (MYSERIAL.available() > 0 && buflen < BUFSIZE)
+#ifdef EMERGENCY_PARSER
+    emergency_parser_enabled = on; // frame bytes could look like M112
+#endif
+#if defined(BAUDRATE_AUTODETECT) && !defined(AT90USB)
+    rx_check_text(on); // or like a wrong baud rate
+#endif
+}
+#endif
+
+#ifdef BINARY_PROTOCOL
+static bool bBinaryMode = false;    // M1090 S1
+static bool bBinaryResend = false;  // a resend was asked for, wait for that frame
+static uint8_t binary_seq = 0;      // sequence number of the next frame
+static uint8_t binary_frame[4 + 8 * 4 + 2];
+static uint8_t binary_count = 0;
+static uint8_t binary_length = 0;
+static bool bBinaryWaiting = false;     // in the middle of a frame the port was found empty
+static unsigned long binary_empty_ms = 0; // at this time
+
+//Frame type -> command, mask bit -> parameter letter
+static const char binary_types[][5] PROGMEM = {"G0", "G1", "G92", "M104", "M140", "M106", "M107", "M109", "M190", "G28", "G90", "G91", "M82", "M83", "M400"};
+static const char binary_params[] PROGMEM = "XYZEFSTP";
+#define BINARY_TYPES (sizeof(binary_types) / sizeof(binary_types[0]))
+
+static void binary_request_resend()
+{
+    MYSERIAL.flush();
+    binary_count = 0;
+    if (bBinaryResend)
+        return;
+    bBinaryResend = true;
+    SERIAL_PROTOCOLPGM(MSG_RESEND);
+    SERIAL_PROTOCOLLN((int)binary_seq);
+    SERIAL_PROTOCOLLNPGM(MSG_OK);
+}
+
+//Value in thousandths as text, "12.5" for 12500
+static char *binary_put_value(char *p, long v)
+{
+    if (v < 0)
     {
-        serial_char = MYSERIAL.read();
-        if (serial_char == '\n' ||
-            serial_char == '\r' ||
-            (serial_char == ':' && comment_mode == false) ||
-            serial_count >= (MAX_CMD_SIZE - 1))
+        *p++ = '-';
+        v = -v;
+    }
+    ultoa((unsigned long)v / 1000, p, 10);
+    p += strlen(p);
+    uint16_t f = (unsigned long)v % 1000;
+    if (f)
+    {
+        *p++ = '.';
+        *p++ = '0' + f / 100;
+        *p++ = '0' + (f / 10) % 10;
+        *p++ = '0' + f % 10;
+        while (p[-1] == '0')
+            p--;
+    }
+    return p;
+}
+
+//Read binary frames from the host port and queue them as command lines, no N or checksum text to check.
+//Frame: 0xA5, seq, type, mask, for every mask bit an int32 value * 1000 (little endian),
+//CRC16/XMODEM of seq..values (little endian). Type 255 switches back to text.
+//True once a frame was taken, the next one waits for the next turn of get_command.
+static bool get_binary_command()
+{
+    //the rest of a frame is given up on once the port stayed empty for 100 ms, not when the loop
+    //was busy for that long: bytes that came in meanwhile are still in the buffer
+    if (binary_count > 0 && MYSERIAL.available() == 0)
+    {
+        if (!bBinaryWaiting)
         {
-            if (!serial_count)
-            {                         //if empty line
-                comment_mode = false; //for new command
-                return;
+            bBinaryWaiting = true;
+            binary_empty_ms = millis();
+        }
+        else if (millis() - binary_empty_ms > 100)
+        {
+            bBinaryWaiting = false;
+            binary_count = 0;
+        }
+        return false;
+    }
+    bBinaryWaiting = false;
+    while (MYSERIAL.available() > 0 && cmdqueue_room(CMD_READER_ROOM))
+    {
+        uint8_t c = MYSERIAL.read();
+        if (binary_count == 0 && c != 0xA5)
+            continue;
+        binary_frame[binary_count++] = c;
+        if (binary_count == 4)
+        {
+            binary_length = 6;
+            for (; c; c >>= 1)
+                binary_length += (c & 1) * 4;
+        }
+        if (binary_count < 4 || binary_count < binary_length)
+            continue;
+        binary_count = 0;
+
+        uint16_t crc = 0;
+        for (uint8_t i = 1; i < binary_length - 2; i++)
+            crc = _crc_xmodem_update(crc, binary_frame[i]);
+        if (crc != (binary_frame[binary_length - 2] | (binary_frame[binary_length - 1] << 8)))
+        {
+            binary_request_resend();
+            continue;
+        }
+        uint8_t diff = binary_frame[1] - binary_seq;
+        if (diff >= 128)
+        {
+            SERIAL_PROTOCOLLNPGM(MSG_OK); // already have it, sent again after a resend; the host still counts an ok for it
+            continue;
+        }
+        if (diff != 0)
+        {
+            binary_request_resend();
+            continue;
+        }
+        binary_seq++;
+        bBinaryResend = false;
+
+        uint8_t type = binary_frame[2];
+        if (type == 255)
+        {
+            bBinaryMode = false;
+            host_text(true);
+            SERIAL_PROTOCOLLNPGM(MSG_OK);
+            return true;
+        }
+        if (type >= BINARY_TYPES)
+        {
+            SERIAL_ERROR_START;
+            SERIAL_ERRORLNPGM("Unknown binary frame");
+            SERIAL_PROTOCOLLNPGM(MSG_OK);
+            continue;
+        }
+
+        char *p = cmd_writing();
+        strcpy_P(p, binary_types[type]);
+        p += strlen(p);
+        uint8_t *v = &binary_frame[4];
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            if (!(binary_frame[3] & (1 << i)))
+                continue;
+            if (p - cmd_writing() > MAX_CMD_SIZE - 16)
+                break; // no room for " X-2147483.648"
+            long l;
+            memcpy(&l, v, 4);
+            v += 4;
+            *p++ = ' ';
+            *p++ = pgm_read_byte(&binary_params[i]);
+            p = binary_put_value(p, l);
+        }
+        *p = 0;
+        cmdqueue_push(false);
+        return true;
+    }
+    return false;
+}
+#endif //BINARY_PROTOCOL
+
+#ifdef SD_BINARY_UPLOAD
+static bool bUploadMode = false; // M1100, the host port carries file blocks
+static bool bUploadResend = false;
+static uint8_t upload_seq = 0;
+static uint8_t upload_header[3]; // seq, length
+static uint8_t upload_block[512];
+static uint16_t upload_count = 0; // bytes of the frame so far, 0 = waiting for 0xB5
+static uint16_t upload_length = 0;
+static uint16_t upload_crc = 0;
+static uint16_t upload_crc_rx = 0;
+static unsigned long upload_bytes = 0;
+static unsigned long upload_start_ms = 0;
+static unsigned long upload_last_ms = 0;  // the port was last seen with bytes in it
+static bool bUploadWaiting = false;       // in the middle of a block the port was found empty
+static unsigned long upload_empty_ms = 0; // at this time
+
+static void upload_start()
+{
+    bUploadMode = true;
+    bUploadResend = false;
+    upload_seq = 0;
+    upload_count = 0;
+    upload_bytes = 0;
+    upload_start_ms = upload_last_ms = millis();
+    bUploadWaiting = false;
+    host_text(false);
+    SERIAL_PROTOCOLPGM("Upload ready W");
+    SERIAL_PROTOCOL(SD_UPLOAD_WINDOW);
+    SERIAL_PROTOCOLLNPGM(" B512");
+}
+
+static void upload_end(bool ok)
+{
+    card.closefile();
+    bUploadMode = false;
+    host_text(true);
+    if (!ok)
+    {
+        SERIAL_ERROR_START;
+        SERIAL_ERRORLNPGM("Upload aborted");
+        return;
+    }
+    unsigned long ms = millis() - upload_start_ms;
+    SERIAL_PROTOCOLPGM(MSG_FILE_SAVED);
+    SERIAL_PROTOCOLPGM(" bytes:");
+    SERIAL_PROTOCOL(upload_bytes);
+    SERIAL_PROTOCOLPGM(" ms:");
+    SERIAL_PROTOCOL(ms);
+    SERIAL_PROTOCOLPGM(" KB/s:");
+    SERIAL_PROTOCOL_F(ms ? upload_bytes / 1.024 / ms : 0.0, 2);
+    SERIAL_PROTOCOLLN("");
+}
+
+static void upload_request_resend()
+{
+    MYSERIAL.flush();
+    upload_count = 0;
+    if (bUploadResend)
+        return;
+    bUploadResend = true;
+    SERIAL_PROTOCOLPGM(MSG_RESEND);
+    SERIAL_PROTOCOLPGM("U");
+    SERIAL_PROTOCOLLN((int)upload_seq);
+}
+
+//Blocks of the M1100 upload: 0xB5, seq, length (little endian, up to 512), data,
+//CRC16/XMODEM of seq..data (little endian). Whole blocks are written as they are,
+//each one answered "ok U<seq>". A zero length block ends the upload.
+static bool get_upload_block()
+{
+    //timeouts count from when the port was found empty, not from the last byte read: after a slow
+    //block write or heater check the bytes that came in meanwhile are still in the buffer
+    if (MYSERIAL.available() == 0)
+    {
+        if (millis() - upload_last_ms > SD_UPLOAD_TIMEOUT * 1000UL)
+        {
+            upload_end(false); // host went away
+            return false;
+        }
+        if (upload_count > 0)
+        {
+            if (!bUploadWaiting)
+            {
+                bUploadWaiting = true;
+                upload_empty_ms = millis();
             }
-            cmdbuffer[bufindw][serial_count] = 0; //terminate string
-            if (!comment_mode)
+            else if (millis() - upload_empty_ms > 100)
             {
-                comment_mode = false; //for new command
-                fromsd[bufindw] = false;
-                if (strchr(cmdbuffer[bufindw], 'N') != NULL)
-                {
-                    strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
-                    gcode_N = (strtol(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL, 10));
-                    if (gcode_N != gcode_LastN + 1 && (strstr_P(cmdbuffer[bufindw], PSTR("M110")) == NULL))
-                    {
-                        SERIAL_ERROR_START;
-                        SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
-                        SERIAL_ERRORLN(gcode_LastN);
-                        //Serial.println(gcode_N);
-                        FlushSerialRequestResend();
-                        serial_count = 0;
-                        return;
-                    }
-
-                    if (strchr(cmdbuffer[bufindw], '*') != NULL)
-                    {
-                        byte checksum = 0;
-                        byte count = 0;
-                        while (cmdbuffer[bufindw][count] != '*')
-                            checksum = checksum ^ cmdbuffer[bufindw][count++];
-                        strchr_pointer = strchr(cmdbuffer[bufindw], '*');
+                bUploadWaiting = false;
+                upload_count = 0; // rest of the frame never came
+            }
+        }
+        return false;
+    }
+    bUploadWaiting = false;
+    upload_last_ms = millis();
+    while (MYSERIAL.available() > 0)
+    {
+        uint8_t c = MYSERIAL.read();
+        if (upload_count == 0)
+        {
+            if (c == 0xB5)
+            {
+                upload_count = 1;
+                upload_crc = 0;
+            }
+            continue;
+        }
+        if (upload_count < 4)
+        {
+            upload_header[upload_count - 1] = c;
+            upload_crc = _crc_xmodem_update(upload_crc, c);
+            if (++upload_count == 4)
+            {
+                upload_length = upload_header[1] | (upload_header[2] << 8);
+                if (upload_length > sizeof(upload_block))
+                    upload_request_resend();
+            }
+            continue;
+        }
+        if (upload_count < 4 + upload_length)
+        {
+            upload_block[upload_count - 4] = c;
+            upload_crc = _crc_xmodem_update(upload_crc, c);
+            upload_count++;
+            continue;
+        }
+        if (upload_count == 4 + upload_length)
+        {
+            upload_crc_rx = c;
+            upload_count++;
+            continue;
+        }
+        upload_crc_rx |= c << 8;
+        upload_count = 0;
+        if (upload_crc_rx != upload_crc)
+        {
+            upload_request_resend();
+            continue;
+        }
+        uint8_t diff = upload_header[0] - upload_seq;
+        if (diff >= 128)
+            continue; // already written, sent again behind a resend
+        if (diff != 0)
+        {
+            upload_request_resend();
+            continue;
+        }
+        upload_seq++;
+        bUploadResend = false;
+        if (upload_length == 0)
+        {
+            upload_end(true);
+            return true;
+        }
+        if (!card.write_block(upload_block, upload_length))
+        {
+            SERIAL_ERROR_START;
+            SERIAL_ERRORLNPGM(MSG_SD_ERR_WRITE_TO_FILE);
+            upload_end(false);
+            return true;
+        }
+        upload_bytes += upload_length;
+#ifdef SD_WRITE_BUFFER
+        card.writeSyncStep(); //the host waits for the ok, nothing comes in meanwhile
+#endif
+        SERIAL_PROTOCOLPGM("ok U");
+        SERIAL_PROTOCOLLN((int)upload_header[0]);
+        return true;
+    }
+    return false;
+}
+#endif //SD_BINARY_UPLOAD
 
-                        if ((int)(strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)) != checksum)
-                        {
-                            SERIAL_ERROR_START;
-                            SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
-                            SERIAL_ERRORLN(gcode_LastN);
-                            FlushSerialRequestResend();
-                            serial_count = 0;
-                            return;
-                        }
-                        //if no errors, continue parsing
-                    }
-                    else
-                    {
-                        SERIAL_ERROR_START;
-                        SERIAL_ERRORPGM(MSG_ERR_NO_CHECKSUM);
-                        SERIAL_ERRORLN(gcode_LastN);
-                        FlushSerialRequestResend();
-                        serial_count = 0;
-                        return;
-                    }
+//Last lines of a finished SD print: report, message on the screen, power off if asked to
+static void sd_print_finished()
+{
+    bool bAutoOff = false;
+    String strPLR = "";
+#ifdef HAS_PLR_MODULE
+    if (b_PLR_MODULE_Detected)
+    {
+        if (tl_AUTO_OFF == 1)
+        {
+            if (languageID == 0)
+                strPLR = "Power off in 5 seconds.";
+            else
+                strPLR = "5���ػ�";
+            bAutoOff = true;
+        }
+    }
+#endif //HAS_PLR_MODULE
+    SERIAL_PROTOCOLLNPGM(MSG_FILE_PRINTED);
+    stoptime = millis();
+    char time[30];
+    long t = (stoptime - starttime) / 1000;
+    int hours, minutes;
+    minutes = (t / 60) % 60;
+    hours = t / 60 / 60;
+    sprintf_P(time, PSTR("%i hours %i minutes"), hours, minutes);
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLN(time);
+    //lcd_setstatus(time);
+#ifdef TL_DWN_CONTROLLER
+    String strTime = " " + String(hours) + " h " + String(minutes) + " m";
+    DWN_Message(DWN_MSG_PRINT_FINISHED, strTime, bAutoOff);
+#endif
+#ifdef TL_TJC_CONTROLLER
+    String strMessage = "";
+    if (languageID == 0)
+        strMessage = "Print finished, " + String(hours) + " hours and " + String(minutes) + " minutes.\r\n";
+    else
+        strMessage = "��ӡ��ɣ�������" + String(hours) + "ʱ" + String(minutes) + "�֡�";
+    strMessage = "msgbox.tMessage.txt=\"" + strMessage + strPLR + "\"";
+    const char *str0 = strMessage.c_str();
+    TenlogScreen_println("sleep=0");
+    TenlogScreen_println("msgbox.vaFromPageID.val=1");
+    TenlogScreen_println("msgbox.vaToPageID.val=1");
+    TenlogScreen_println("msgbox.vtOKValue.txt=\"\"");
+    TenlogScreen_println(str0);
+    TenlogScreen_println("page msgbox");
+#endif //TL_TJC_CONTROLLER
+    iBeepCount = 10;
+    if (bAutoOff && b_PLR_MODULE_Detected)
+    {
+        card.sdprinting = 0;
+        command_G4(5.0);
+        command_M81();
+    }
+    card.printingHasFinished();
+    WriteLastZYM(t);
+    card.checkautostart(true);
+}
 
-                    gcode_LastN = gcode_N;
-                    //if no errors, continue parsing
-                }
-                else // if we don't receive 'N' but still see '*'
-                {
-                    if ((strchr(cmdbuffer[bufindw], '*') != NULL))
-                    {
-                        SERIAL_ERROR_START;
-                        SERIAL_ERRORPGM(MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM);
-                        SERIAL_ERRORLN(gcode_LastN);
-                        serial_count = 0;
-                        return;
-                    }
-                }
-                if ((strchr(cmdbuffer[bufindw], 'G') != NULL))
-                {
-                    strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-                    switch ((int)((strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL))))
-                    {
-                    case 0:
-                    case 1:
-                    case 2:
-                    case 3:
-                        if (Stopped == false)
-                        { // If printer is stopped by an error the G[0-3] codes are ignored.
-#ifdef SDSUPPORT
-                            if (card.saving)
-                                break;
-#endif //SDSUPPORT \
-    //SERIAL_PROTOCOLLNPGM(MSG_OK);
-                        }
-                        else
-                        {
-                            SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
-                            //LCD_MESSAGEPGM(MSG_STOPPED);
-                        }
-                        break;
-                    default:
-                        break;
-                    }
-                }
-                bufindw = (bufindw + 1) % BUFSIZE;
-                buflen += 1;
+//N and checksum of a host or screen line. False, after asking for a resend, when it has to be dropped.
+static bool check_line(char *line)
+{
+    command_tokens t;
+    tokenize_command(t, line);
+    char *npos = token_pointer(t, 'N');
+    char *cpos = token_pointer(t, '*');
+    if (npos != NULL)
+    {
+        gcode_N = parse_long(npos + 1);
+        if (gcode_N != gcode_LastN + 1 && (strstr_P(line, PSTR("M110")) == NULL))
+        {
+            SERIAL_ERROR_START;
+            SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
+            SERIAL_ERRORLN(gcode_LastN);
+            //Serial.println(gcode_N);
+            FlushSerialRequestResend();
+            return false;
+        }
+
+        if (cpos != NULL)
+        {
+            byte checksum = 0;
+            for (char *p = line; p < cpos; p++)
+                checksum = checksum ^ *p;
+
+            if (parse_long(cpos + 1) != checksum)
+            {
+                SERIAL_ERROR_START;
+                SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
+                SERIAL_ERRORLN(gcode_LastN);
+                FlushSerialRequestResend();
+                return false;
             }
-            serial_count = 0; //clear buffer
+            //if no errors, continue parsing
         }
         else
         {
-            if (serial_char == ';')
-                comment_mode = true;
-            if (!comment_mode)
-                cmdbuffer[bufindw][serial_count++] = serial_char;
+            SERIAL_ERROR_START;
+            SERIAL_ERRORPGM(MSG_ERR_NO_CHECKSUM);
+            SERIAL_ERRORLN(gcode_LastN);
+            FlushSerialRequestResend();
+            return false;
         }
+
+        gcode_LastN = gcode_N;
+        //if no errors, continue parsing
     }
-#ifdef SDSUPPORT
-    if (card.sdprinting == 0 || serial_count != 0)
+    else // if we don't receive 'N' but still see '*'
     {
-        return;
+        if (cpos != NULL)
+        {
+            SERIAL_ERROR_START;
+            SERIAL_ERRORPGM(MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM);
+            SERIAL_ERRORLN(gcode_LastN);
+            return false;
+        }
     }
-    while (!card.eof() && buflen < BUFSIZE)
+    char *gpos = token_pointer(t, 'G');
+    if (gpos != NULL)
     {
-        int16_t n = card.get();
-        serial_char = (char)n;
-        if (serial_char == '\n' ||
-            serial_char == '\r' ||
-            (serial_char == ':' && comment_mode == false) ||
-            serial_count >= (MAX_CMD_SIZE - 1) || n == -1)
+        switch ((int)parse_float(gpos + 1))
         {
-            if (card.eof())
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            if (Stopped == false)
+            { // If printer is stopped by an error the G[0-3] codes are ignored.
+#ifdef SDSUPPORT
+                if (card.saving)
+                    break;
+#endif //SDSUPPORT \
+    //SERIAL_PROTOCOLLNPGM(MSG_OK);
+            }
+            else
             {
+                SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+                //LCD_MESSAGEPGM(MSG_STOPPED);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
 
-                bool bAutoOff = false;
-                String strPLR = "";
-#ifdef HAS_PLR_MODULE
-                if (b_PLR_MODULE_Detected)
-                {
-                    if (tl_AUTO_OFF == 1)
-                    {
-                        if (languageID == 0)
-                            strPLR = "Power off in 5 seconds.";
-                        else
-                            strPLR = "5���ػ�";
-                        bAutoOff = true;
-                    }
-                }
-#endif //HAS_PLR_MODULE
-                SERIAL_PROTOCOLLNPGM(MSG_FILE_PRINTED);
-                stoptime = millis();
-                char time[30];
-                long t = (stoptime - starttime) / 1000;
-                int hours, minutes;
-                minutes = (t / 60) % 60;
-                hours = t / 60 / 60;
-                sprintf_P(time, PSTR("%i hours %i minutes"), hours, minutes);
-                SERIAL_ECHO_START;
-                SERIAL_ECHOLN(time);
-                //lcd_setstatus(time);
-#ifdef TL_DWN_CONTROLLER
-                String strTime = " " + String(hours) + " h " + String(minutes) + " m";
-                DWN_Message(DWN_MSG_PRINT_FINISHED, strTime, bAutoOff);
+//Every text input goes through one line reader. The host port, the SD file and the TJC screen
+//each keep their own comment state; the half line at cmd_writing() belongs to cmd_owner until
+//its end of line, the other sources wait, so lines from two inputs can no longer mix.
+#define CMD_SRC_HOST 0
+#define CMD_SRC_SD 1
+#define CMD_SRC_TJC 2
+#define CMD_SRC_DWN 3
+#define CMD_SOURCES 4
+#define CMD_ROUNDS 8 // lines or frames a source may add per get_command call
+
+#define CMD_COMMENT 1 // after a ';', the rest of the line is skipped
+#define CMD_NOISE 2   // screen garbage in the line, it is dropped
+static int8_t cmd_owner = -1;
+static uint8_t cmd_comment[CMD_SOURCES];
+static uint8_t cmd_first = 0; // source served first, moves on every call
+
+#ifdef SDSUPPORT
+static unsigned long sd_read_bytes = 0; // SD ingest for M1080
+static unsigned long sd_read_us = 0;
+
+//SD lines are read whole: the file scans its cached block for the line end and copies the line
+//straight into the queue, instead of a get() with its position and cluster bookkeeping per byte.
+static bool read_sd_line()
+{
+    if (!cmdqueue_room(CMD_READER_ROOM))
+        return false;
+    unsigned long us = micros();
+    char *line = cmd_writing();
+    int16_t n;
+    uint8_t empty = 0;
+    do
+    {
+        n = card.getLine(line, MAX_CMD_SIZE - 1);
+        if (n > 0)
+            sd_read_bytes += n;
+    } while (n == 1 && (line[0] == '\n' || line[0] == '\r') && ++empty < 4); // the '\n' of "\r\n", blank lines
+    int16_t len = 0;
+    while (len < n && line[len] != ';' && line[len] != '\n' && line[len] != '\r')
+        len++;
+    if (len < n && line[len] == ';' && line[n - 1] != '\n' && line[n - 1] != '\r')
+    {
+        int16_t m;
+        do // skip the rest of a comment too long for the buffer
+        {
+            m = card.getLine(line + len, MAX_CMD_SIZE - 1 - len);
+            if (m > 0)
+                sd_read_bytes += m;
+        } while (m > 0 && line[len + m - 1] != '\n' && line[len + m - 1] != '\r');
+    }
+    sd_read_us += micros() - us;
+    if (card.eof())
+        sd_print_finished();
+    if (len == 0)
+        return n >= 0;
+    line[len] = 0;
+    cmdqueue_push(true);
+    return true;
+}
+#endif
+
+static bool source_available(uint8_t src)
+{
+    switch (src)
+    {
+    case CMD_SRC_HOST:
+        return MYSERIAL.available() > 0;
+#ifdef SDSUPPORT
+    case CMD_SRC_SD:
+        return card.sdprinting != 0 && !card.eof();
 #endif
 #ifdef TL_TJC_CONTROLLER
-                String strMessage = "";
-                if (languageID == 0)
-                    strMessage = "Print finished, " + String(hours) + " hours and " + String(minutes) + " minutes.\r\n";
-                else
-                    strMessage = "��ӡ��ɣ�������" + String(hours) + "ʱ" + String(minutes) + "�֡�";
-                strMessage = "msgbox.tMessage.txt=\"" + strMessage + strPLR + "\"";
-                const char *str0 = strMessage.c_str();
-                TenlogScreen_println("sleep=0");
-                TenlogScreen_println("msgbox.vaFromPageID.val=1");
-                TenlogScreen_println("msgbox.vaToPageID.val=1");
-                TenlogScreen_println("msgbox.vtOKValue.txt=\"\"");
-                TenlogScreen_println(str0);
-                TenlogScreen_println("page msgbox");
-#endif //TL_TJC_CONTROLLER
-                iBeepCount = 10;
-                if (bAutoOff && b_PLR_MODULE_Detected)
-                {
-                    card.sdprinting = 0;
-                    command_G4(5.0);
-                    command_M81();
-                }
-                card.printingHasFinished();
-                WriteLastZYM(t);
-                card.checkautostart(true);
-            }
+    case CMD_SRC_TJC:
+        return MSerial2_available() > 0;
+#endif
+    }
+    return false;
+}
+
+static int16_t source_read(uint8_t src)
+{
+    switch (src)
+    {
+#ifdef TL_TJC_CONTROLLER
+    case CMD_SRC_TJC:
+        return MSerial2_read();
+#endif
+    }
+    return MYSERIAL.read();
+}
+
+//Take characters from the host port or screen until a line ends. True when one did, queued or not.
+static bool read_text_line(uint8_t src)
+{
+    while (source_available(src) && cmdqueue_room(CMD_READER_ROOM))
+    {
+        int16_t n = source_read(src);
+        char c = (char)n;
+        if (c == '\n' ||
+            c == '\r' ||
+            (c == ':' && cmd_comment[src] == 0) ||
+            serial_count >= (MAX_CMD_SIZE - 1) || n == -1)
+        {
+            uint8_t comment = cmd_comment[src];
+            cmd_comment[src] = 0;
+            cmd_owner = -1;
             if (!serial_count)
+                return true; // empty line
+            cmd_writing()[serial_count] = 0;
+            serial_count = 0;
+            if (comment == CMD_NOISE || !check_line(cmd_writing()))
+                return true;
+#ifdef EMERGENCY_PARSER
+            if (src == CMD_SRC_HOST && emergency_line(cmd_writing()))
             {
-                comment_mode = false; //for new command
-                return;               //if empty line
+                send_ok(false);
+                return true;
             }
-            cmdbuffer[bufindw][serial_count] = 0; //terminate string
-            // if(!comment_mode){
-            fromsd[bufindw] = true;
-            buflen += 1;
-            bufindw = (bufindw + 1) % BUFSIZE;
-            //      }
-            comment_mode = false; //for new command
-            serial_count = 0;     //clear buffer
+#endif
+            cmdqueue_push(false);
+            return true;
         }
-        else
+        cmd_owner = src;
+        if (c == ';' && cmd_comment[src] == 0)
+            cmd_comment[src] = CMD_COMMENT;
+#ifdef TL_TJC_CONTROLLER
+        if (src == CMD_SRC_TJC && (c < 0 || (c == 'h' && cmd_writing()[0] != 'M')))
+            cmd_comment[src] = CMD_NOISE;
+#endif
+        if (cmd_comment[src] == 0)
+            cmd_writing()[serial_count++] = c;
+    }
+    return false;
+}
+
+static bool read_source(uint8_t src)
+{
+#ifdef TL_DWN_CONTROLLER
+    if (src == CMD_SRC_DWN)
+    {
+        if (!get_command_dwn())
+            return false;
+        process_command_dwn();
+        return true;
+    }
+#endif
+    if (cmd_owner != -1 && cmd_owner != src)
+        return false; // another source is halfway through a line
+#ifdef SD_BINARY_UPLOAD
+    if (src == CMD_SRC_HOST && bUploadMode)
+        return get_upload_block();
+#endif
+#ifdef SDSUPPORT
+    if (src == CMD_SRC_SD)
+        return source_available(src) && read_sd_line();
+#endif
+#ifdef BINARY_PROTOCOL
+    if (src == CMD_SRC_HOST && bBinaryMode)
+        return get_binary_command();
+#endif
+    return read_text_line(src);
+}
+
+//One line or screen frame per source in turn, starting with a different source on every call,
+//so a busy screen or SD file cannot hold back the host port and the other way round.
+void get_command()
+{
+    for (uint8_t round = 0; round < CMD_ROUNDS; round++)
+    {
+        bool bMore = false;
+        for (uint8_t i = 0; i < CMD_SOURCES; i++)
         {
-            if (serial_char == ';')
-                comment_mode = true;
-            if (!comment_mode)
-                cmdbuffer[bufindw][serial_count++] = serial_char;
+            if (read_source((cmd_first + i) % CMD_SOURCES))
+                bMore = true;
         }
+        if (!bMore)
+            break;
     }
-
-#endif //SDSUPPORT
+    cmd_first = (cmd_first + 1) % CMD_SOURCES;
 }
 
 #define DEFINE_PGM_READ_ANY(type, reader)          \
@@ -3313,6 +3974,10 @@ void PrintStopOrFinished()
 #ifdef PRINT_FROM_Z_HEIGHT
     PrintFromZHeightFound = true;
     print_from_z_target = 0.0;
+#endif
+#ifdef SD_LAYER_INDEX
+    bLayerJump = false;
+    sd_skip_queued = 0;
 #endif
     //raised_parked_position[X_AXIS] = current_position[X_AXIS];														//By zyf
     raised_parked_position[Y_AXIS] = 0; //By zyf
@@ -3386,9 +4051,80 @@ void command_G1(float XValue, float YValue, float ZValue, float EValue, int iMod
     }
 }
 
+#ifdef HEAT_WAIT_LOOKAHEAD
+bool bHeatLookahead = true;
+
+static bool queued_code_value(const char *cmd, char code, float &fValue)
+{
+    const char *p = strchr(cmd, code);
+    if (p == NULL)
+        return false;
+    fValue = parse_float(p + 1);
+    return true;
+}
+
+// Switch on the heaters of the temperature commands queued right behind this wait,
+// so a M190 followed by M109 heats bed and nozzle at the same time.
+// Stops at the first command that is not a temperature, fan or message command.
+static void heat_lookahead()
+{
+    if (!bHeatLookahead)
+        return;
+    int pos = bufindr;
+    for (int i = 1; i < buflen; i++)
+    {
+        pos = cmdqueue_next(pos);
+        const char *cmd = &cmdqueue[pos + 1];
+        if (cmd[0] == 'N')
+        {
+            cmd = strchr(cmd, ' ');
+            if (cmd == NULL)
+                return;
+            cmd++;
+        }
+        if (cmd[0] != 'M')
+            return;
+
+        float fValue;
+        int iM = parse_long(cmd + 1);
+        if (iM == 104 || iM == 109)
+        {
+            if (!queued_code_value(cmd, 'S', fValue) && !queued_code_value(cmd, 'R', fValue))
+                continue;
+            float fT;
+            int e = active_extruder;
+            if (queued_code_value(cmd, 'T', fT))
+                e = fT;
+            if (e >= EXTRUDERS || fValue <= degTargetHotend(e))
+                continue;
+            setTargetHotend(fValue, e);
+#ifdef DUAL_X_CARRIAGE
+            if ((dual_x_carriage_mode == DXC_DUPLICATION_MODE || dual_x_carriage_mode == DXC_MIRROR_MODE) && e == 0)
+                setTargetHotend1(fValue + duplicate_extruder_temp_offset);
+#endif
+            setWatch();
+        }
+        else if (iM == 140 || iM == 190)
+        {
+            if (!queued_code_value(cmd, 'S', fValue) && !queued_code_value(cmd, 'R', fValue))
+                continue;
+            if (fValue > degTargetBed())
+                setTargetBed(fValue);
+        }
+        else if (iM != 105 && iM != 106 && iM != 107 && iM != 117 && iM != 82 && iM != 83)
+        {
+            return;
+        }
+    }
+}
+#endif //HEAT_WAIT_LOOKAHEAD
+
 void command_M190(int SValue = -1)
 {
 #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+#ifdef EMERGENCY_PARSER
+    bHeatingStop = false;
+#endif
     unsigned long codenum; //throw away variable
     //LCD_MESSAGEPGM(MSG_BED_HEATING);
 
@@ -3407,13 +4143,16 @@ void command_M190(int SValue = -1)
         setTargetBed(SValue);
         CooldownNoWait = true;
     }
+#ifdef HEAT_WAIT_LOOKAHEAD
+    heat_lookahead();
+#endif
     codenum = millis();
 
     target_direction = isHeatingBed(); // true if heating, false if cooling
     card.heating = true;
     while (target_direction ? (isHeatingBed()) : (isCoolingBed() && (CooldownNoWait == false)) && card.isFileOpen())
     {
-#ifdef TL_DWN_CONTROLLER
+#if defined(TL_DWN_CONTROLLER) || defined(EMERGENCY_PARSER)
         if (bHeatingStop)
             break;
 #endif
@@ -3514,7 +4253,7 @@ void command_M104(int iT = -1, int iS = -1)
 
 void command_M109(int SValue = -1)
 { // M109 - Wait for extruder heater to reach target.
-#ifdef TL_DWN_CONTROLLER
+#if defined(TL_DWN_CONTROLLER) || defined(EMERGENCY_PARSER)
     bHeatingStop = false;
 #endif
     unsigned long codenum; //throw away variable
@@ -3570,6 +4309,9 @@ void command_M109(int SValue = -1)
 #endif
 
     setWatch();
+#ifdef HEAT_WAIT_LOOKAHEAD
+    heat_lookahead();
+#endif
     codenum = millis();
 
     /* See if we are heating up or cooling down */
@@ -3595,7 +4337,7 @@ void command_M109(int SValue = -1)
         (target_direction ? isHeatingHotend(tmp_extruder) : (isCoolingHotend(tmp_extruder) && !CooldownNoWait)) && card.isFileOpen())
     {
 #endif //TEMP_RESIDENCY_TIME
-#ifdef TL_DWN_CONTROLLER
+#if defined(TL_DWN_CONTROLLER) || defined(EMERGENCY_PARSER)
         if (bHeatingStop)
             break;
 #endif
@@ -4447,6 +5189,7 @@ void process_commands()
     unsigned long codenum; //throw away variable
     char *starpos = NULL;
 
+    tokenize_command(cmd_tokens, cmd_current());
     if (code_seen('G'))
     {
         switch ((int)code_value())
@@ -4592,7 +5335,7 @@ void process_commands()
             starpos = (strchr(strchr_pointer + 4, '*'));
             if (starpos != NULL)
             {
-                char *npos = strchr(cmdbuffer[bufindr], 'N');
+                char *npos = strchr(cmd_current(), 'N');
                 strchr_pointer = strchr(npos, ' ') + 1;
                 *(starpos - 1) = '\0';
             }
@@ -4602,6 +5345,23 @@ void process_commands()
                  //processed in write to file routine above
                  //card,saving = false;
             break;
+#ifdef SD_BINARY_UPLOAD
+        case 1100: //M1100 - Binary upload to SD, the blocks follow this ok
+            starpos = (strchr(strchr_pointer + 6, '*'));
+            if (starpos != NULL)
+            {
+                char *npos = strchr(cmd_current(), 'N');
+                strchr_pointer = strchr(npos, ' ') + 1;
+                *(starpos - 1) = '\0';
+            }
+            card.openFile(strchr_pointer + 6, strchr_pointer + 6, false);
+            if (card.saving)
+            {
+                card.saving = false; // the blocks go in through get_upload_block, not the command queue
+                upload_start();
+            }
+            break;
+#endif
         case 30: //M30 <filename> Delete File
             if (card.cardOK)
             {
@@ -4609,7 +5369,7 @@ void process_commands()
                 starpos = (strchr(strchr_pointer + 4, '*'));
                 if (starpos != NULL)
                 {
-                    char *npos = strchr(cmdbuffer[bufindr], 'N');
+                    char *npos = strchr(cmd_current(), 'N');
                     strchr_pointer = strchr(npos, ' ') + 1;
                     *(starpos - 1) = '\0';
                 }
@@ -4633,7 +5393,7 @@ void process_commands()
             starpos = (strchr(strchr_pointer + 5, '*'));
             if (starpos != NULL)
             {
-                char *npos = strchr(cmdbuffer[bufindr], 'N');
+                char *npos = strchr(cmd_current(), 'N');
                 strchr_pointer = strchr(npos, ' ') + 1;
                 *(starpos - 1) = '\0';
             }
@@ -4705,41 +5465,59 @@ void process_commands()
                 break;
             }
 #if defined(TEMP_0_PIN) && TEMP_0_PIN > -1
-            SERIAL_PROTOCOLPGM("ok T:");
-            SERIAL_PROTOCOL_F(degHotend(0), 1);
-            SERIAL_PROTOCOLPGM("/");
-            SERIAL_PROTOCOL_F(degTargetHotend(0), 1);
-#if defined(TEMP_1_PIN) && TEMP_1_PIN > -1
-            SERIAL_PROTOCOLPGM(" T1:");
-            SERIAL_PROTOCOL_F(degHotend(1), 1);
-            SERIAL_PROTOCOLPGM("/");
-            SERIAL_PROTOCOL_F(degTargetHotend(1), 1);
-#endif
-#if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
-            SERIAL_PROTOCOLPGM(" B:");
-            SERIAL_PROTOCOL_F(degBed(), 1);
-            SERIAL_PROTOCOLPGM(" /");
-            SERIAL_PROTOCOL_F(degTargetBed(), 1);
-#endif //TEMP_BED_PIN
+            SERIAL_PROTOCOLPGM("ok");
+            print_heaterstates(tmp_extruder);
 #else
             SERIAL_ERROR_START;
             SERIAL_ERRORLNPGM(MSG_ERR_NO_THERMISTORS);
-#endif
-            SERIAL_PROTOCOLPGM(" @:");
-            SERIAL_PROTOCOL(getHeaterPower(tmp_extruder));
-
-            SERIAL_PROTOCOLPGM(" B@:");
-            SERIAL_PROTOCOL(getHeaterPower(-1));
-
             SERIAL_PROTOCOLLN("");
+#endif
             return;
             break;
+#ifdef AUTO_REPORT_TEMPERATURES
+        case 155: // M155 S<seconds> report temperatures every S seconds, S0 stops
+            if (code_seen('S'))
+            {
+                iAutoReportSeconds = constrain(code_value(), 0, 60);
+                lNextTempReport = millis() + iAutoReportSeconds * 1000UL;
+            }
+            break;
+#endif
         case 109:
             command_M109();
             break;
+        case 108: // M108 only ends a wait through the emergency parser, a queued one runs after the wait it was for
+            break;
+        case 112: // M112 emergency stop
+            kill();
+            break;
         case 190: // M190 - Wait for bed heater to reach target.
             command_M190();
             break;
+#ifdef HEAT_WAIT_LOOKAHEAD
+        case 1070: // M1070 H<nozzle> B<bed> [T<extruder>] heat both at once and wait, L<0|1> lookahead off/on
+        {
+            if (code_seen('L'))
+                bHeatLookahead = code_value() > 0;
+            int iBed = -1;
+            int iNozzle = -1;
+            if (code_seen('B'))
+                iBed = code_value();
+            if (code_seen('H'))
+                iNozzle = code_value();
+            if (iNozzle > -1)
+            {
+                if (setTargetedHotend(109))
+                    break;
+                command_M104(tmp_extruder, iNozzle);
+            }
+            if (iBed > -1)
+                command_M190(iBed);
+            if (iNozzle > -1)
+                command_M109(iNozzle);
+        }
+        break;
+#endif //HEAT_WAIT_LOOKAHEAD
 
 #if defined(FAN_PIN) && FAN_PIN > -1
         case 106: //M106 Fan On
@@ -4896,6 +5674,15 @@ void process_commands()
         break;
         case 115: // M115
             SERIAL_PROTOCOLPGM(MSG_M115_REPORT);
+#ifdef AUTO_REPORT_TEMPERATURES
+            SERIAL_PROTOCOLLNPGM("Cap:AUTOREPORT_TEMP:1");
+#endif
+#ifdef BINARY_PROTOCOL
+            SERIAL_PROTOCOLLNPGM("Cap:BINARY_PROTOCOL:1");
+#endif
+#ifdef SD_BINARY_UPLOAD
+            SERIAL_PROTOCOLLNPGM("Cap:BINARY_FILE_TRANSFER:1");
+#endif
             break;
         case 117: // M117 display message
             starpos = (strchr(strchr_pointer + 5, '*'));
@@ -5060,7 +5847,7 @@ void process_commands()
                 default:
                     SERIAL_ECHO_START;
                     SERIAL_ECHOPGM(MSG_UNKNOWN_COMMAND);
-                    SERIAL_ECHO(cmdbuffer[bufindr]);
+                    SERIAL_ECHO(cmd_current());
                     SERIAL_ECHOLNPGM("\"");
                 }
             }
@@ -5274,11 +6061,52 @@ void process_commands()
             PID_autotune(temp, e, c);
         }
         break;
+#ifdef THERMAL_MODEL_PROTECTION
+        case 310: // M310 Thermal model protection
+        {
+            int e = 0;
+            if (code_seen('E'))
+                e = code_value();
+            if (e < 0 || e > EXTRUDERS)
+                e = EXTRUDERS;
+            if (code_seen('G'))
+                tm_gain[e] = code_value();
+            if (code_seen('C'))
+                tm_tau[e] = code_value();
+            if (code_seen('R'))
+                tm_tolerance = code_value();
+            if (code_seen('N'))
+                tm_count = constrain(code_value(), 1, 255); //counted in a byte per heater
+            if (code_seen('S'))
+                tm_enabled = code_value() > 0;
+            thermal_model_reset();
+
+            SERIAL_PROTOCOLPGM("Thermal model S:");
+            SERIAL_PROTOCOL((int)tm_enabled);
+            SERIAL_PROTOCOLPGM(" R:");
+            SERIAL_PROTOCOL(tm_tolerance);
+            SERIAL_PROTOCOLPGM(" N:");
+            SERIAL_PROTOCOLLN(tm_count);
+            for (int h = 0; h <= EXTRUDERS; h++)
+            {
+                SERIAL_PROTOCOLPGM(" E");
+                SERIAL_PROTOCOL(h == EXTRUDERS ? -1 : h);
+                SERIAL_PROTOCOLPGM(" G:");
+                SERIAL_PROTOCOL(tm_gain[h]);
+                SERIAL_PROTOCOLPGM(" C:");
+                SERIAL_PROTOCOLLN(tm_tau[h]);
+            }
+        }
+        break;
+#endif //THERMAL_MODEL_PROTECTION
         case 400: // M400 finish all moves
         {
             st_synchronize();
         }
         break;
+        case 410: // M410 quick stop, from the host it was already done by the emergency parser and not queued
+            quick_stop_and_sync();
+            break;
         case 500: // M500 Store settings in EEPROM
         {
             Config_StoreSettings();
@@ -5753,6 +6581,135 @@ void process_commands()
         break;
 #endif //PRINT_FROM_Z_HEIGHT
 
+#ifdef TEMP_TELEMETRY
+        case 1060: //M1060 Heater telemetry
+        {
+            if (code_seen('I'))
+            {
+                telemetry_interval = code_value_long();
+            }
+            else if (code_seen('C'))
+            {
+                telemetry_clear();
+            }
+            else
+            {
+                bool toSD = false;
+                if (code_seen('F'))
+                    toSD = code_value() > 0;
+                telemetry_dump(toSD);
+            }
+        }
+        break;
+#endif //TEMP_TELEMETRY
+
+#ifdef BINARY_PROTOCOL
+        case 1090: //M1090 S1 binary frames on the host port after this ok, S0 text
+            if (code_seen('S'))
+            {
+                bBinaryMode = code_value() > 0;
+                host_text(!bBinaryMode);
+                bBinaryResend = false;
+                binary_seq = 0;
+                binary_count = 0;
+            }
+            break;
+#endif
+
+        case 1080: //M1080 Command queue, baud rate and serial statistics, R resets the counters
+            SERIAL_ECHO_START;
+            SERIAL_ECHOPGM("Queue bytes:");
+            SERIAL_ECHO(CMDQUEUE_SIZE);
+            SERIAL_ECHOPGM(" commands:");
+            SERIAL_ECHO(buflen);
+            SERIAL_ECHOPGM(" peak:");
+            SERIAL_ECHO((int)cmdqueue_peak);
+            SERIAL_ECHOPGM(" avg:");
+            SERIAL_PROTOCOL_F(cmdqueue_depth_count ? (float)cmdqueue_depth_sum / cmdqueue_depth_count : 0.0, 1);
+            SERIAL_ECHOLN("");
+#ifndef AT90USB
+            SERIAL_ECHO_START;
+            SERIAL_ECHOPGM("Baud:");
+            SERIAL_ECHO(MYSERIAL.baud_requested);
+            SERIAL_ECHOPGM(" actual:");
+            SERIAL_ECHO(MYSERIAL.baud_actual);
+            SERIAL_ECHOPGM(" error:");
+            SERIAL_PROTOCOL_F((MYSERIAL.baud_actual - MYSERIAL.baud_requested) * 100.0 / MYSERIAL.baud_requested, 2);
+            SERIAL_ECHOPGM("% U2X:");
+            SERIAL_ECHOLN((int)MYSERIAL.baud_u2x);
+#endif
+#if TX_BUFFER_SIZE > 0 && !defined(AT90USB)
+            SERIAL_ECHO_START;
+            SERIAL_ECHOPGM("TX buffer:");
+            SERIAL_ECHO(TX_BUFFER_SIZE);
+            SERIAL_ECHOPGM(" full:");
+            SERIAL_ECHO(MYSERIAL.tx_overflows);
+            SERIAL_ECHOPGM(" blocked ms:");
+            SERIAL_ECHOLN(MYSERIAL.tx_blocked_us / 1000);
+#endif
+#ifdef SDSUPPORT
+            SERIAL_ECHO_START;
+            SERIAL_ECHOPGM("SD read bytes:");
+            SERIAL_ECHO(sd_read_bytes);
+            SERIAL_ECHOPGM(" ms:");
+            SERIAL_ECHO(sd_read_us / 1000);
+            SERIAL_ECHOPGM(" KB/s:");
+            SERIAL_PROTOCOL_F(sd_read_us ? sd_read_bytes * 1000.0 / 1.024 / sd_read_us : 0.0, 1);
+            SERIAL_ECHOLN("");
+#endif
+            if (code_seen('R'))
+            {
+                cmdqueue_peak = buflen;
+                cmdqueue_depth_sum = 0;
+                cmdqueue_depth_count = 0;
+#ifdef SDSUPPORT
+                sd_read_bytes = 0;
+                sd_read_us = 0;
+#endif
+#if TX_BUFFER_SIZE > 0 && !defined(AT90USB)
+                MYSERIAL.tx_overflows = 0;
+                MYSERIAL.tx_blocked_us = 0;
+#endif
+            }
+            break;
+
+#ifdef SDSUPPORT
+        case 1110: //M1110 SD block cache hits and misses, R resets them
+        {
+            const char *kind[3] = {"FAT", " dir", " data"};
+            SERIAL_ECHO_START;
+            SERIAL_ECHOPGM("SD cache slots:");
+            SERIAL_ECHO(SD_CACHE_SLOTS);
+            SERIAL_ECHOLN("");
+            SERIAL_ECHO_START;
+            for (uint8_t i = 0; i < 3; i++)
+            {
+                SERIAL_ECHO(kind[i]);
+                SERIAL_ECHOPGM(" hits:");
+                SERIAL_ECHO(SdVolume::cacheHits(i));
+                SERIAL_ECHOPGM(" misses:");
+                SERIAL_ECHO(SdVolume::cacheMisses(i));
+            }
+            SERIAL_ECHOLN("");
+            if (code_seen('R'))
+                SdVolume::cacheStatsClear();
+        }
+        break;
+
+        case 1120: //M1120 SD read speed over the first S blocks of the card, 200 by default
+        {
+            long blocks = code_seen('S') ? code_value_long() : 200;
+            card.readSpeed(constrain(blocks, 1, 2048));
+        }
+        break;
+
+#ifdef SD_FILE_META
+        case 1130: //M1130 print time, filament, layers and size of the selected file
+            card.printMeta();
+            break;
+#endif
+#endif
+
 #ifndef TL_TJC_CONTROLLER
         case 1050:
         {
@@ -5796,6 +6753,9 @@ void process_commands()
             //lcd_reset_alert_level();
             gcode_LastN = Stopped_gcode_LastN;
             FlushSerialRequestResend();
+#ifndef AT90USB
+            MYSERIAL.flushTx();
+#endif
             resetFunc();
             break;
         }
@@ -5807,7 +6767,7 @@ void process_commands()
     {
         SERIAL_ECHO_START;
         SERIAL_ECHOPGM(MSG_UNKNOWN_COMMAND);
-        SERIAL_ECHO(cmdbuffer[bufindr]);
+        SERIAL_ECHO(cmd_current());
         SERIAL_ECHOLNPGM("\"");
     }
     ClearToSend();
@@ -5826,10 +6786,10 @@ void ClearToSend()
 {
     previous_millis_cmd = millis();
 #ifdef SDSUPPORT
-    if (fromsd[bufindr])
+    if (cmd_fromsd())
         return;
 #endif //SDSUPPORT
-    SERIAL_PROTOCOLLNPGM(MSG_OK);
+    send_ok(true);
 }
 
 #ifdef POWER_LOSS_RECOVERY
@@ -6395,8 +7355,24 @@ void Power_Off_Handler(bool MoveX, bool M81)
 
 #endif //POWER_LOSS_TRIGGER_BY_PIN
 
+//Drop all planned moves and take the position the steppers stopped at
+void quick_stop_and_sync()
+{
+    quickStop();
+    for (int8_t i = 0; i < NUM_AXIS; i++)
+        current_position[i] = st_get_position(i) / axis_steps_per_unit[i];
+    plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+}
+
 void manage_inactivity()
 {
+#ifdef EMERGENCY_PARSER
+    if (bQuickStopRequest)
+    {
+        bQuickStopRequest = false;
+        quick_stop_and_sync();
+    }
+#endif
     if ((millis() - previous_millis_cmd) > max_inactive_time)
         if (max_inactive_time)
             kill();
@@ -6450,6 +7426,20 @@ void manage_inactivity()
         memcpy(destination, current_position, sizeof(destination));
         prepare_move();
     }
+#endif
+#ifdef SD_LAYER_INDEX
+    //heat waits and an idle printer only, the scan would hold up the moves of an SD or host print
+    if (card.heating || (card.sdprinting != 1 && !blocks_queued()))
+        card.layerIndexStep();
+#endif
+#ifdef SD_WRITE_BUFFER
+#ifdef SD_BINARY_UPLOAD
+    if (!bUploadMode) //get_upload_block() syncs between blocks, a sync here could overrun the RX buffer
+#endif
+        card.writeSyncStep();
+#endif
+#if defined(TEMP_TELEMETRY) && defined(SDSUPPORT)
+    telemetry_log();
 #endif
     check_axes_activity();
 }
@@ -6846,7 +7836,11 @@ void sdcard_tlcontroller()
 
     for (uint16_t i = 0; i < fileCnt; i++)
     {
+#ifdef SD_SORT_NEWEST_FIRST
+        card.getfilename_sorted(i);
+#else
         card.getfilename(fileCnt - 1 - i);
+#endif
         String strFN = String(card.filename);
 
         if (!card.filenameIsDir && strFN.length() > 0)
@@ -6857,6 +7851,8 @@ void sdcard_tlcontroller()
                 strFN.toLowerCase();
                 String strLFN = strFN;
                 iFileID++;
+                if (iFileID > (i_print_page_id + 1) * 6)
+                    break; //a later page has files, that is all the page needs to know
                 if (iFileID >= (i_print_page_id)*6 + 1 && iFileID <= (i_print_page_id + 1) * 6)
                 {
                     int iFTemp = iFileID - (i_print_page_id)*6;
@@ -6926,7 +7922,11 @@ void sdcard_tlcontroller()
 
     for (uint16_t i = 0; i < fileCnt; i++)
     {
+#ifdef SD_SORT_NEWEST_FIRST
+        card.getfilename_sorted(i);
+#else
         card.getfilename(fileCnt - 1 - i);    //card.getfilename(i);   // card.getfilename(fileCnt-1-i); //By Zyf sort by time desc
+#endif
         String strFN = String(card.filename); // + " | " + String(card.filename);
 
         if (!card.filenameIsDir && strFN.length() > 0)
@@ -6937,6 +7937,8 @@ void sdcard_tlcontroller()
                 strFN.toLowerCase();
                 String strLFN = strFN;
                 iFileID++;
+                if (iFileID > (i_print_page_id + 1) * 6)
+                    break; //a later page has files, that is all the page needs to know
                 if (iFileID >= (i_print_page_id)*6 + 1 && iFileID <= (i_print_page_id + 1) * 6)
                 {
                     strFN = String(card.filename);
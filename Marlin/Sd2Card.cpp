@@ -22,6 +22,61 @@
 #ifdef SDSUPPORT
 #include "Sd2Card.h"
 //------------------------------------------------------------------------------
+#ifdef SD_CHECK_AND_RETRY
+// CRC-CCITT of a data block, x^16 + x^12 + x^5 + 1, a byte at a time
+static const uint16_t crcTable[256] PROGMEM = {
+  0X0000, 0X1021, 0X2042, 0X3063, 0X4084, 0X50A5, 0X60C6, 0X70E7,
+  0X8108, 0X9129, 0XA14A, 0XB16B, 0XC18C, 0XD1AD, 0XE1CE, 0XF1EF,
+  0X1231, 0X0210, 0X3273, 0X2252, 0X52B5, 0X4294, 0X72F7, 0X62D6,
+  0X9339, 0X8318, 0XB37B, 0XA35A, 0XD3BD, 0XC39C, 0XF3FF, 0XE3DE,
+  0X2462, 0X3443, 0X0420, 0X1401, 0X64E6, 0X74C7, 0X44A4, 0X5485,
+  0XA56A, 0XB54B, 0X8528, 0X9509, 0XE5EE, 0XF5CF, 0XC5AC, 0XD58D,
+  0X3653, 0X2672, 0X1611, 0X0630, 0X76D7, 0X66F6, 0X5695, 0X46B4,
+  0XB75B, 0XA77A, 0X9719, 0X8738, 0XF7DF, 0XE7FE, 0XD79D, 0XC7BC,
+  0X48C4, 0X58E5, 0X6886, 0X78A7, 0X0840, 0X1861, 0X2802, 0X3823,
+  0XC9CC, 0XD9ED, 0XE98E, 0XF9AF, 0X8948, 0X9969, 0XA90A, 0XB92B,
+  0X5AF5, 0X4AD4, 0X7AB7, 0X6A96, 0X1A71, 0X0A50, 0X3A33, 0X2A12,
+  0XDBFD, 0XCBDC, 0XFBBF, 0XEB9E, 0X9B79, 0X8B58, 0XBB3B, 0XAB1A,
+  0X6CA6, 0X7C87, 0X4CE4, 0X5CC5, 0X2C22, 0X3C03, 0X0C60, 0X1C41,
+  0XEDAE, 0XFD8F, 0XCDEC, 0XDDCD, 0XAD2A, 0XBD0B, 0X8D68, 0X9D49,
+  0X7E97, 0X6EB6, 0X5ED5, 0X4EF4, 0X3E13, 0X2E32, 0X1E51, 0X0E70,
+  0XFF9F, 0XEFBE, 0XDFDD, 0XCFFC, 0XBF1B, 0XAF3A, 0X9F59, 0X8F78,
+  0X9188, 0X81A9, 0XB1CA, 0XA1EB, 0XD10C, 0XC12D, 0XF14E, 0XE16F,
+  0X1080, 0X00A1, 0X30C2, 0X20E3, 0X5004, 0X4025, 0X7046, 0X6067,
+  0X83B9, 0X9398, 0XA3FB, 0XB3DA, 0XC33D, 0XD31C, 0XE37F, 0XF35E,
+  0X02B1, 0X1290, 0X22F3, 0X32D2, 0X4235, 0X5214, 0X6277, 0X7256,
+  0XB5EA, 0XA5CB, 0X95A8, 0X8589, 0XF56E, 0XE54F, 0XD52C, 0XC50D,
+  0X34E2, 0X24C3, 0X14A0, 0X0481, 0X7466, 0X6447, 0X5424, 0X4405,
+  0XA7DB, 0XB7FA, 0X8799, 0X97B8, 0XE75F, 0XF77E, 0XC71D, 0XD73C,
+  0X26D3, 0X36F2, 0X0691, 0X16B0, 0X6657, 0X7676, 0X4615, 0X5634,
+  0XD94C, 0XC96D, 0XF90E, 0XE92F, 0X99C8, 0X89E9, 0XB98A, 0XA9AB,
+  0X5844, 0X4865, 0X7806, 0X6827, 0X18C0, 0X08E1, 0X3882, 0X28A3,
+  0XCB7D, 0XDB5C, 0XEB3F, 0XFB1E, 0X8BF9, 0X9BD8, 0XABBB, 0XBB9A,
+  0X4A75, 0X5A54, 0X6A37, 0X7A16, 0X0AF1, 0X1AD0, 0X2AB3, 0X3A92,
+  0XFD2E, 0XED0F, 0XDD6C, 0XCD4D, 0XBDAA, 0XAD8B, 0X9DE8, 0X8DC9,
+  0X7C26, 0X6C07, 0X5C64, 0X4C45, 0X3CA2, 0X2C83, 0X1CE0, 0X0CC1,
+  0XEF1F, 0XFF3E, 0XCF5D, 0XDF7C, 0XAF9B, 0XBFBA, 0X8FD9, 0X9FF8,
+  0X6E17, 0X7E36, 0X4E55, 0X5E74, 0X2E93, 0X3EB2, 0X0ED1, 0X1EF0
+};
+#define CRC_ADD(crc, b) ((crc) << 8 ^ pgm_read_word(&crcTable[((crc) >> 8 ^ (b)) & 0XFF]))
+//------------------------------------------------------------------------------
+// CRC7 of a command, with the end bit
+static uint8_t CRC7(const uint8_t* data, uint8_t n) {
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t d = data[i];
+    for (uint8_t j = 0; j < 8; j++) {
+      crc <<= 1;
+      if ((d ^ crc) & 0X80) crc ^= 0X09;
+      d <<= 1;
+    }
+  }
+  return (crc << 1) | 1;
+}
+#else  // SD_CHECK_AND_RETRY
+#define CRC_ADD(crc, b) (crc)
+#endif  // SD_CHECK_AND_RETRY
+//------------------------------------------------------------------------------
 #ifndef SOFTWARE_SPI
 // functions for hardware SPI
 //------------------------------------------------------------------------------
@@ -60,23 +115,68 @@ void spiRead(uint8_t* buf, uint16_t nbyte) {
   buf[nbyte] = SPDR;
 }
 //------------------------------------------------------------------------------
+#define SPI_WAIT() while (!(SPSR & (1 << SPIF))) { /* Intentionally left empty */ }
+// take a byte and start the next one at once, storing it and its CRC run
+// while that one shifts in
+#define SPI_READ_NEXT(dst, crc) do { \
+    SPI_WAIT(); \
+    uint8_t b_ = SPDR; \
+    SPDR = 0XFF; \
+    dst = b_; \
+    crc = CRC_ADD(crc, b_); \
+  } while (0)
+/** SPI read a data block and the CRC after it - only one call so force inline
+ * \return false if SD_CHECK_AND_RETRY is on and the CRC does not match
+ */
+static inline __attribute__((always_inline))
+bool spiReadBlock(uint8_t* buf) {
+  uint16_t crc = 0;
+  SPDR = 0XFF;
+  for (uint16_t i = 0; i < 512; i += 4) {
+    SPI_READ_NEXT(buf[i], crc);
+    SPI_READ_NEXT(buf[i + 1], crc);
+    SPI_READ_NEXT(buf[i + 2], crc);
+    SPI_READ_NEXT(buf[i + 3], crc);
+  }
+  SPI_WAIT();
+  uint16_t cardCrc = SPDR << 8;
+  SPDR = 0XFF;
+  SPI_WAIT();
+  cardCrc |= SPDR;
+#ifdef SD_CHECK_AND_RETRY
+  return cardCrc == crc;
+#else  // SD_CHECK_AND_RETRY
+  (void)cardCrc;
+  return true;
+#endif  // SD_CHECK_AND_RETRY
+}
+//------------------------------------------------------------------------------
 /** SPI send a byte */
 static void spiSend(uint8_t b) {
   SPDR = b;
   while (!(SPSR & (1 << SPIF))) { /* Intentionally left empty */ }
 }
 //------------------------------------------------------------------------------
-/** SPI send block - only one call so force inline */
+/** SPI send block - only one call so force inline
+ * The next byte is fetched and added to the CRC while the one before shifts out.
+ * \return CRC of the block, 0 without SD_CHECK_AND_RETRY
+ */
 static inline __attribute__((always_inline))
-  void spiSendBlock(uint8_t token, const uint8_t* buf) {
+  uint16_t spiSendBlock(uint8_t token, const uint8_t* buf) {
+  uint16_t crc = 0;
   SPDR = token;
   for (uint16_t i = 0; i < 512; i += 2) {
-    while (!(SPSR & (1 << SPIF))) { /* Intentionally left empty */ }
-    SPDR = buf[i];
-    while (!(SPSR & (1 << SPIF))) { /* Intentionally left empty */ }
-    SPDR = buf[i + 1];
+    uint8_t b = buf[i];
+    crc = CRC_ADD(crc, b);
+    SPI_WAIT();
+    SPDR = b;
+    b = buf[i + 1];
+    crc = CRC_ADD(crc, b);
+    SPI_WAIT();
+    SPDR = b;
   }
-  while (!(SPSR & (1 << SPIF))) { /* Intentionally left empty */ }
+  SPI_WAIT();
+  return crc;
 }
 //------------------------------------------------------------------------------
 #else  // SOFTWARE_SPI
@@ -117,6 +217,23 @@ static void spiRead(uint8_t* buf, uint16_t nbyte) {
   }
 }
 //------------------------------------------------------------------------------
+/** Soft SPI read a data block and the CRC after it */
+static bool spiReadBlock(uint8_t* buf) {
+  uint16_t crc = 0;
+  for (uint16_t i = 0; i < 512; i++) {
+    buf[i] = spiRec();
+    crc = CRC_ADD(crc, buf[i]);
+  }
+  uint16_t cardCrc = spiRec() << 8;
+  cardCrc |= spiRec();
+#ifdef SD_CHECK_AND_RETRY
+  return cardCrc == crc;
+#else  // SD_CHECK_AND_RETRY
+  (void)cardCrc;
+  return true;
+#endif  // SD_CHECK_AND_RETRY
+}
+//------------------------------------------------------------------------------
 /** Soft SPI send byte */
 static void spiSend(uint8_t data) {
   // no interrupts during byte send - about 8 us
@@ -142,16 +259,22 @@ static void spiSend(uint8_t data) {
 }
 //------------------------------------------------------------------------------
 /** Soft SPI send block */
-  void spiSendBlock(uint8_t token, const uint8_t* buf) {
+  uint16_t spiSendBlock(uint8_t token, const uint8_t* buf) {
+  uint16_t crc = 0;
   spiSend(token);
   for (uint16_t i = 0; i < 512; i++) {
     spiSend(buf[i]);
+    crc = CRC_ADD(crc, buf[i]);
   }
+  return crc;
 }
 #endif  // SOFTWARE_SPI
 //------------------------------------------------------------------------------
 // send command and return error code.  Return zero for OK
 uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
+  // any other command ends an open readStream() first
+  if (streamBlock_ != 0XFFFFFFFF && cmd != CMD12) streamStop();
+
   // select card
   chipSelectLow();
 
@@ -165,10 +288,16 @@ uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
   for (int8_t s = 24; s >= 0; s -= 8) spiSend(arg >> s);
 
   // send CRC
+#ifdef SD_CHECK_AND_RETRY
+  // every command needs it once CMD59 turned the check on
+  uint8_t d[5] = {(uint8_t)(cmd | 0x40), (uint8_t)(arg >> 24), (uint8_t)(arg >> 16), (uint8_t)(arg >> 8), (uint8_t)arg};
+  spiSend(CRC7(d, 5));
+#else  // SD_CHECK_AND_RETRY
   uint8_t crc = 0XFF;
   if (cmd == CMD0) crc = 0X95;  // correct crc for CMD0 with arg 0
   if (cmd == CMD8) crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
   spiSend(crc);
+#endif  // SD_CHECK_AND_RETRY
 
   // skip stuff byte for stop read
   if (cmd == CMD12) spiRec();
@@ -285,6 +414,12 @@ bool Sd2Card::eraseSingleBlockEnable() {
  */
 bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
   errorCode_ = type_ = 0;
+  streamBlock_ = 0XFFFFFFFF;
+#ifdef SD_CHECK_AND_RETRY
+  crcCheck_ = false;
+  slowDowns_ = 0;
+  cleanBlocks_ = 0;
+#endif  // SD_CHECK_AND_RETRY
   chipSelectPin_ = chipSelectPin;
   // 16-bit init start time allows over a minute
   uint16_t t0 = (uint16_t)millis();
@@ -331,6 +466,10 @@ bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
     }
     type(SD_CARD_TYPE_SD2);
   }
+#ifdef SD_CHECK_AND_RETRY
+  // the card checks command and write CRCs and sends good ones with its data
+  crcCheck_ = cardCommand(CMD59, 1) == R1_IDLE_STATE;
+#endif  // SD_CHECK_AND_RETRY
   // initialize card and send host supports SDHC if SD2
   arg = type() == SD_CARD_TYPE_SD2 ? 0X40000000 : 0;
 
@@ -375,14 +514,22 @@ bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
 bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst) {
   // use address if not SDHC card
   if (type()!= SD_CARD_TYPE_SDHC) blockNumber <<= 9;
+#ifdef SD_CHECK_AND_RETRY
+  uint8_t tries = 0;
+ retry:
+#endif  // SD_CHECK_AND_RETRY
   if (cardCommand(CMD17, blockNumber)) {
     error(SD_CARD_ERROR_CMD17);
-    goto fail;
+    chipSelectHigh();
+  } else if (readData(dst, 512)) {
+#ifdef SD_CHECK_AND_RETRY
+    cleanBlock();
+#endif  // SD_CHECK_AND_RETRY
+    return true;
   }
-  return readData(dst, 512);
-
- fail:
-  chipSelectHigh();
+#ifdef SD_CHECK_AND_RETRY
+  if (crcRetry(tries)) goto retry;
+#endif  // SD_CHECK_AND_RETRY
   return false;
 }
 //------------------------------------------------------------------------------
@@ -412,11 +559,22 @@ bool Sd2Card::readData(uint8_t* dst, uint16_t count) {
     goto fail;
   }
   // transfer data
-  spiRead(dst, count);
+  if (count == 512) {
+#ifdef SD_CHECK_AND_RETRY
+    if (!spiReadBlock(dst) && crcCheck_) {
+      error(SD_CARD_ERROR_READ_CRC);
+      goto fail;
+    }
+#else  // SD_CHECK_AND_RETRY
+    spiReadBlock(dst);
+#endif  // SD_CHECK_AND_RETRY
+  } else {
+    spiRead(dst, count);
 
-  // discard CRC
-  spiRec();
-  spiRec();
+    // discard CRC
+    spiRec();
+    spiRec();
+  }
   chipSelectHigh();
   return true;
 
@@ -482,6 +640,52 @@ bool Sd2Card::readStop() {
   return false;
 }
 //------------------------------------------------------------------------------
+/**
+ * Read a block of a file read front to back.
+ *
+ * The first block starts a CMD18 multiple block read that is left open, so
+ * the blocks after it come without a command and access time each. Any
+ * other command closes it first.
+ *
+ * \param[in] block Logical block to be read.
+ * \param[out] dst Pointer to the location that will receive the data.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+bool Sd2Card::readStream(uint32_t block, uint8_t* dst) {
+#ifdef SD_CHECK_AND_RETRY
+  uint8_t tries = 0;
+ retry:
+#endif  // SD_CHECK_AND_RETRY
+  if (block != streamBlock_) {
+    streamStop();
+    if (!readStart(block)) goto fail;
+    streamBlock_ = block;
+  }
+  if (!readData(dst)) {
+    streamStop();
+    goto fail;
+  }
+  streamBlock_++;
+#ifdef SD_CHECK_AND_RETRY
+  cleanBlock();
+#endif  // SD_CHECK_AND_RETRY
+  return true;
+
+ fail:
+#ifdef SD_CHECK_AND_RETRY
+  if (crcRetry(tries)) goto retry;
+#endif  // SD_CHECK_AND_RETRY
+  return false;
+}
+//------------------------------------------------------------------------------
+/** End the multiple block read of readStream(), if one is open. */
+void Sd2Card::streamStop() {
+  if (streamBlock_ == 0XFFFFFFFF) return;
+  streamBlock_ = 0XFFFFFFFF;
+  readStop();
+}
+//------------------------------------------------------------------------------
 /**
  * Set the SPI clock rate.
  *
@@ -500,9 +704,46 @@ bool Sd2Card::setSckRate(uint8_t sckRateID) {
     return false;
   }
   spiRate_ = sckRateID;
+#ifdef SD_CHECK_AND_RETRY
+  spiRateTop_ = sckRateID;
+  cleanBlocks_ = 0;
+#endif  // SD_CHECK_AND_RETRY
   return true;
 }
 //------------------------------------------------------------------------------
+#ifdef SD_CHECK_AND_RETRY
+/**
+ * A transfer failed. Only a bad CRC, read or reported by the card for a
+ * write, is tried again, at most SD_CRC_RETRIES times for the block, and
+ * makes the SPI clock one step slower unless it is at SPI_SIXTEENTH_SPEED.
+ * A missing card, a timeout or a programming error fails at once.
+ *
+ * \param[in,out] tries Retries of this block so far.
+ * \return true if the transfer should be tried again.
+ */
+bool Sd2Card::crcRetry(uint8_t &tries) {
+  if (errorCode_ != SD_CARD_ERROR_READ_CRC &&
+      errorCode_ != SD_CARD_ERROR_WRITE_CRC) return false;
+  if (tries++ >= SD_CRC_RETRIES) return false;
+  cleanBlocks_ = 0;
+  if (spiRate_ < SPI_SIXTEENTH_SPEED) {
+    spiRate_++;
+    slowDowns_++;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+/**
+ * A block went through: after SD_CLEAN_BLOCKS of them without a bad CRC
+ * step a slowed down SPI clock one step back up toward the setSckRate() one.
+ */
+void Sd2Card::cleanBlock() {
+  if (spiRate_ <= spiRateTop_ || ++cleanBlocks_ < SD_CLEAN_BLOCKS) return;
+  spiRate_--;
+  cleanBlocks_ = 0;
+}
+#endif  // SD_CHECK_AND_RETRY
+//------------------------------------------------------------------------------
 // wait for card to go not busy
 bool Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
   uint16_t t0 = millis();
@@ -526,6 +767,10 @@ bool Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
 bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
   // use address if not SDHC card
   if (type() != SD_CARD_TYPE_SDHC) blockNumber <<= 9;
+#ifdef SD_CHECK_AND_RETRY
+  uint8_t tries = 0;
+ retry:
+#endif  // SD_CHECK_AND_RETRY
   if (cardCommand(CMD24, blockNumber)) {
     error(SD_CARD_ERROR_CMD24);
     goto fail;
@@ -543,10 +788,16 @@ bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
     goto fail;
   }
   chipSelectHigh();
+#ifdef SD_CHECK_AND_RETRY
+  cleanBlock();
+#endif  // SD_CHECK_AND_RETRY
   return true;
 
  fail:
   chipSelectHigh();
+#ifdef SD_CHECK_AND_RETRY
+  if (crcRetry(tries)) goto retry;
+#endif  // SD_CHECK_AND_RETRY
   return false;
 }
 //------------------------------------------------------------------------------
@@ -571,14 +822,21 @@ bool Sd2Card::writeData(const uint8_t* src) {
 //------------------------------------------------------------------------------
 // send one block of data for write block or write multiple blocks
 bool Sd2Card::writeData(uint8_t token, const uint8_t* src) {
-  spiSendBlock(token, src);
+  uint16_t crc = spiSendBlock(token, src);
 
+#ifdef SD_CHECK_AND_RETRY
+  spiSend(crc >> 8);
+  spiSend(crc);
+#else  // SD_CHECK_AND_RETRY
+  (void)crc;
   spiSend(0xff);  // dummy crc
   spiSend(0xff);  // dummy crc
+#endif  // SD_CHECK_AND_RETRY
 
   status_ = spiRec();
   if ((status_ & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
-    error(SD_CARD_ERROR_WRITE);
+    error((status_ & DATA_RES_MASK) == DATA_RES_CRC_ERROR ?
+          SD_CARD_ERROR_WRITE_CRC : SD_CARD_ERROR_WRITE);
     goto fail;
   }
   return true;
@@ -51,6 +51,10 @@ uint16_t const SD_ERASE_TIMEOUT = 10000;
 uint16_t const SD_READ_TIMEOUT = 300;
 /** write time out ms */
 uint16_t const SD_WRITE_TIMEOUT = 600;
+/** tries again of a block with a bad CRC, each one SPI clock step slower */
+uint8_t const SD_CRC_RETRIES = 3;
+/** blocks without a bad CRC before the SPI clock goes one step faster again */
+uint16_t const SD_CLEAN_BLOCKS = 1000;
 //------------------------------------------------------------------------------
 // SD card errors
 /** timeout error for command CMD0 (initialize card in SPI mode) */
@@ -103,6 +107,10 @@ uint8_t const SD_CARD_ERROR_WRITE_TIMEOUT = 0X17;
 uint8_t const SD_CARD_ERROR_SCK_RATE = 0X18;
 /** init() not called */
 uint8_t const SD_CARD_ERROR_INIT_NOT_CALLED = 0X19;
+/** card sent data with a bad CRC */
+uint8_t const SD_CARD_ERROR_READ_CRC = 0X1A;
+/** card rejected write data for a bad CRC */
+uint8_t const SD_CARD_ERROR_WRITE_CRC = 0X1B;
 //------------------------------------------------------------------------------
 // card types
 /** Standard capacity V1 SD card */
@@ -154,7 +162,8 @@ uint8_t const SPI_SCK_PIN = SOFT_SPI_SCK_PIN;
 class Sd2Card {
  public:
   /** Construct an instance of Sd2Card. */
-  Sd2Card() : errorCode_(SD_CARD_ERROR_INIT_NOT_CALLED), type_(0) {}
+  Sd2Card() : errorCode_(SD_CARD_ERROR_INIT_NOT_CALLED), type_(0),
+    streamBlock_(0XFFFFFFFF) {}
   uint32_t cardSize();
   bool erase(uint32_t firstBlock, uint32_t lastBlock);
   bool eraseSingleBlockEnable();
@@ -204,7 +213,17 @@ class Sd2Card {
   bool readData(uint8_t *dst);
   bool readStart(uint32_t blockNumber);
   bool readStop();
+  bool readStream(uint32_t block, uint8_t* dst);
+  void streamStop();
   bool setSckRate(uint8_t sckRateID);
+  /** \return the SPI clock rate selector in use, see setSckRate() */
+  uint8_t spiRate() const {return spiRate_;}
+#ifdef SD_CHECK_AND_RETRY
+  /** \return true if read data is checked against the card's CRC */
+  bool crcCheck() const {return crcCheck_;}
+  /** \return bad CRCs that made the SPI clock slower */
+  uint8_t slowDowns() const {return slowDowns_;}
+#endif  // SD_CHECK_AND_RETRY
   /** Return the card type: SD V1, SD V2 or SDHC
    * \return 0 - SD V1, 1 - SD V2, or 3 - SDHC.
    */
@@ -220,6 +239,15 @@ class Sd2Card {
   uint8_t spiRate_;
   uint8_t status_;
   uint8_t type_;
+  uint32_t streamBlock_;  // next block of the open readStream(), 0XFFFFFFFF if none
+#ifdef SD_CHECK_AND_RETRY
+  bool crcCheck_;         // the card took CMD59, its data CRCs are good
+  uint8_t slowDowns_;
+  uint8_t spiRateTop_;    // rate set by setSckRate(), cleanBlock() goes back up to it
+  uint16_t cleanBlocks_;  // blocks since the last bad CRC
+  bool crcRetry(uint8_t &tries);
+  void cleanBlock();
+#endif  // SD_CHECK_AND_RETRY
   // private functions
   uint8_t cardAcmd(uint8_t cmd, uint32_t arg) {
     cardCommand(CMD55, 0);
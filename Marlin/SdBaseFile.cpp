@@ -37,6 +37,9 @@ bool SdBaseFile::addCluster() {
     firstCluster_ = curCluster_;
     flags_ |= F_FILE_DIR_DIRTY;
   }
+#ifdef SD_SEEK_RUNS
+  seekRunsClear();
+#endif  // SD_SEEK_RUNS
   return true;
 
  fail:
@@ -51,19 +54,18 @@ bool SdBaseFile::addDirCluster() {
   if (fileSize_/sizeof(dir_t) >= 0XFFFF) goto fail;
 
   if (!addCluster()) goto fail;
-  if (!vol_->cacheFlush()) goto fail;
 
   block = vol_->clusterStartBlock(curCluster_);
 
   // set cache to first block of cluster
-  vol_->cacheSetBlockNumber(block, true);
+  if (!vol_->cacheSetBlock(block, SdVolume::CACHE_TYPE_DIR)) goto fail;
 
   // zero first block of cluster
-  memset(vol_->cacheBuffer_.data, 0, 512);
+  memset(vol_->cache()->data, 0, 512);
 
   // zero rest of cluster
   for (uint8_t i = 1; i < vol_->blocksPerCluster_; i++) {
-    if (!vol_->writeBlock(block + i, vol_->cacheBuffer_.data)) goto fail;
+    if (!vol_->writeBlock(block + i, vol_->cache()->data)) goto fail;
   }
   // Increase directory file size by cluster size
   fileSize_ += 512UL << vol_->clusterSizeShift_;
@@ -76,7 +78,9 @@ bool SdBaseFile::addDirCluster() {
 // cache a file's directory entry
 // return pointer to cached entry or null for failure
 dir_t* SdBaseFile::cacheDirEntry(uint8_t action) {
-  if (!vol_->cacheRawBlock(dirBlock_, action)) goto fail;
+  if (!vol_->cacheRawBlock(dirBlock_, action, SdVolume::CACHE_TYPE_DIR)) {
+    goto fail;
+  }
   return vol_->cache()->dir + dirIndex_;
 
  fail:
@@ -165,6 +169,10 @@ bool SdBaseFile::createContiguous(SdBaseFile* dirFile,
 
   // insure sync() will update dir entry
   flags_ |= F_FILE_DIR_DIRTY;
+#ifdef SD_SEEK_RUNS
+  seekRunsClear();
+  flags_ |= F_FILE_CONTIGUOUS;
+#endif  // SD_SEEK_RUNS
 
   return sync();
 
@@ -493,7 +501,10 @@ bool SdBaseFile::mkdir(SdBaseFile* parent, const uint8_t dname[11]) {
 
   // cache block for '.'  and '..'
   block = vol_->clusterStartBlock(firstCluster_);
-  if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) goto fail;
+  if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE,
+                           SdVolume::CACHE_TYPE_DIR)) {
+    goto fail;
+  }
 
   // copy '.' to block
   memcpy(&vol_->cache()->dir[0], &d, sizeof(d));
@@ -853,10 +864,11 @@ bool SdBaseFile::openParent(SdBaseFile* dir) {
   // start block for '..'
   lbn = vol_->clusterStartBlock(cluster);
   // first block of parent dir
-  if (!vol_->cacheRawBlock(lbn, SdVolume::CACHE_FOR_READ)) {
+  if (!vol_->cacheRawBlock(lbn, SdVolume::CACHE_FOR_READ,
+                           SdVolume::CACHE_TYPE_DIR)) {
     goto fail;
   }
-  p = &vol_->cacheBuffer_.dir[1];
+  p = &vol_->cache()->dir[1];
   // verify name for '../..'
   if (p->name[0] != '.' || p->name[1] != '.') goto fail;
   // '..' is pointer to first cluster of parent. open '../..' to find parent
@@ -1067,6 +1079,10 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
         if (curPosition_ == 0) {
           // use first cluster in file
           curCluster_ = firstCluster_;
+#ifdef SD_SEEK_RUNS
+        } else if (flags_ & F_FILE_CONTIGUOUS) {
+          curCluster_++;
+#endif  // SD_SEEK_RUNS
         } else {
           // get next cluster from FAT
           if (!vol_->fatGet(curCluster_, &curCluster_)) goto fail;
@@ -1080,11 +1096,14 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
     if (n > (512 - offset)) n = 512 - offset;
 
     // no buffering needed if n == 512
-    if (n == 512 && block != vol_->cacheBlockNumber()) {
+    if (n == 512 && vol_->cacheFind(block) < 0) {
       if (!vol_->readBlock(block, dst)) goto fail;
     } else {
       // read block to cache and copy data to caller
-      if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) goto fail;
+      if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_READ,
+          isDir() ? SdVolume::CACHE_TYPE_DIR : SdVolume::CACHE_TYPE_DATA)) {
+        goto fail;
+      }
       uint8_t* src = vol_->cache()->data + offset;
       memcpy(dst, src, n);
     }
@@ -1098,6 +1117,83 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
   return -1;
 }
 //------------------------------------------------------------------------------
+/** Read up to and including the next '\n' or '\r' of a text file.
+ *
+ * The line is looked for in the cached block, so the cluster and position
+ * bookkeeping happens once per block instead of once per byte as with read().
+ * With SD_READ_AHEAD the blocks come from the read-ahead buffers instead of
+ * the cache shared with FAT and directory access.
+ *
+ * \param[out] buf Where the line goes, not terminated.
+ * \param[in] nbyte Most bytes to read, a longer line is cut there.
+ *
+ * \return The number of bytes read, zero at end of file, -1 on error.
+ */
+int16_t SdBaseFile::readLine(char* buf, uint16_t nbyte) {
+  uint16_t done = 0;
+  uint16_t offset;
+  uint32_t block;  // raw device block number
+
+  // error if not open or write only
+  if (!isOpen() || !(flags_ & O_READ)) goto fail;
+
+  // max bytes left in file
+  if (nbyte >= (fileSize_ - curPosition_)) {
+    nbyte = fileSize_ - curPosition_;
+  }
+  while (done < nbyte) {
+    offset = curPosition_ & 0X1FF;  // offset in block
+    if (type_ == FAT_FILE_TYPE_ROOT_FIXED) {
+      block = vol_->rootDirStart() + (curPosition_ >> 9);
+    } else {
+      uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+      if (offset == 0 && blockOfCluster == 0) {
+        // start of new cluster
+        if (curPosition_ == 0) {
+          // use first cluster in file
+          curCluster_ = firstCluster_;
+#ifdef SD_SEEK_RUNS
+        } else if (flags_ & F_FILE_CONTIGUOUS) {
+          curCluster_++;
+#endif  // SD_SEEK_RUNS
+        } else {
+          // get next cluster from FAT
+          if (!vol_->fatGet(curCluster_, &curCluster_)) goto fail;
+        }
+      }
+      block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
+    }
+#ifdef SD_READ_AHEAD
+    const uint8_t* src = vol_->readAhead(block);
+    if (!src) goto fail;
+    src += offset;
+#else  // SD_READ_AHEAD
+    if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) goto fail;
+    const uint8_t* src = vol_->cache()->data + offset;
+#endif  // SD_READ_AHEAD
+
+    // scan what is left of the line in this block
+    uint16_t n = nbyte - done;
+    if (n > (512 - offset)) n = 512 - offset;
+    uint16_t i = 0;
+    bool eol = false;
+    while (i < n) {
+      uint8_t c = src[i++];
+      buf[done++] = c;
+      if (c == '\n' || c == '\r') {
+        eol = true;
+        break;
+      }
+    }
+    curPosition_ += i;
+    if (eol) break;
+  }
+  return done;
+
+ fail:
+  return -1;
+}
+//------------------------------------------------------------------------------
 /** Read the next directory entry from a directory file.
  *
  * \param[out] dir The dir_t struct that will receive the data.
@@ -1308,7 +1404,10 @@ bool SdBaseFile::rename(SdBaseFile* dirFile, const char* newPath) {
   if (dirCluster) {
     // get new dot dot
     uint32_t block = vol_->clusterStartBlock(dirCluster);
-    if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) goto fail;
+    if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_READ,
+                             SdVolume::CACHE_TYPE_DIR)) {
+      goto fail;
+    }
     memcpy(&entry, &vol_->cache()->dir[1], sizeof(entry));
 
     // free unused cluster
@@ -1316,7 +1415,10 @@ bool SdBaseFile::rename(SdBaseFile* dirFile, const char* newPath) {
 
     // store new dot dot
     block = vol_->clusterStartBlock(firstCluster_);
-    if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) goto fail;
+    if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE,
+                             SdVolume::CACHE_TYPE_DIR)) {
+      goto fail;
+    }
     memcpy(&vol_->cache()->dir[1], &entry, sizeof(entry));
   }
   return vol_->cacheFlush();
@@ -1332,6 +1434,46 @@ bool SdBaseFile::rename(SdBaseFile* dirFile, const char* newPath) {
   return false;
 }
 //------------------------------------------------------------------------------
+/** Allocate contiguous clusters after the end of a file being written.
+ *
+ * Like createContiguous() but the file size stays what has been written,
+ * so a file cut short has no garbage at its end.  write() goes on through
+ * the reserved clusters without searching and updating the FAT for each.
+ * Call truncate() with fileSize() to free what is left of them.
+ *
+ * \param[in] size Bytes to reserve.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * Reasons for failure include the file is not open for write, the position
+ * is not at the end of the cluster chain, no run of free clusters that long
+ * or an I/O error.
+ */
+bool SdBaseFile::reserve(uint32_t size) {
+  uint32_t count;
+  uint32_t next;
+  if (!isFile() || !(flags_ & O_WRITE) || size == 0) goto fail;
+
+  count = ((size - 1) >> (vol_->clusterSizeShift_ + 9)) + 1;
+  if (firstCluster_ == 0) {
+    if (!vol_->allocContiguous(count, &firstCluster_)) goto fail;
+    flags_ |= F_FILE_DIR_DIRTY;
+  } else {
+    // link the run to the last cluster, allocContiguous() tries right after it
+    if (curPosition_ != fileSize_ || curCluster_ == 0) goto fail;
+    if (!vol_->fatGet(curCluster_, &next) || !vol_->isEOC(next)) goto fail;
+    next = curCluster_;
+    if (!vol_->allocContiguous(count, &next)) goto fail;
+  }
+#ifdef SD_SEEK_RUNS
+  seekRunsClear();
+#endif  // SD_SEEK_RUNS
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
 /** Remove a directory file.
  *
  * The directory file will be removed only if it is empty and is not the
@@ -1472,6 +1614,13 @@ bool SdBaseFile::seekSet(uint32_t pos) {
   nCur = (curPosition_ - 1) >> (vol_->clusterSizeShift_ + 9);
   nNew = (pos - 1) >> (vol_->clusterSizeShift_ + 9);
 
+#ifdef SD_SEEK_RUNS
+  if (isFile() && (nNew < nCur || curPosition_ == 0 || nNew - nCur > 1)) {
+    if (!seekCluster(nNew, curPosition_ ? nCur : 0XFFFFFFFF)) goto fail;
+    curPosition_ = pos;
+    goto done;
+  }
+#endif  // SD_SEEK_RUNS
   if (nNew < nCur || curPosition_ == 0) {
     // must follow chain from first cluster
     curCluster_ = firstCluster_;
@@ -1491,6 +1640,77 @@ bool SdBaseFile::seekSet(uint32_t pos) {
   return false;
 }
 //------------------------------------------------------------------------------
+#ifdef SD_SEEK_RUNS
+// One pass over the file's FAT chain. A file in one run gets F_FILE_CONTIGUOUS,
+// any other has its first SD_SEEK_RUNS runs kept in the volume.
+bool SdBaseFile::mapRuns() {
+  uint32_t c = firstCluster_;
+  uint32_t next;
+  uint32_t n = 0;
+  uint8_t runs = 1;
+  vol_->runClear();
+  vol_->runStart_[0] = 0;
+  vol_->runCluster_[0] = c;
+  while (1) {
+    if (!vol_->fatGet(c, &next)) goto fail;
+    n++;
+    if (vol_->isEOC(next)) break;
+    if (next != c + 1) {
+      // the clusters after the last run are found through the FAT
+      if (runs == SD_SEEK_RUNS) break;
+      vol_->runStart_[runs] = n;
+      vol_->runCluster_[runs++] = next;
+    }
+    c = next;
+  }
+  if (runs == 1 && vol_->isEOC(next)) {
+    flags_ |= F_FILE_CONTIGUOUS;
+    return true;
+  }
+  vol_->runFile_ = firstCluster_;
+  vol_->runCount_ = runs;
+  vol_->runEnd_ = n;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
+// set curCluster_ to cluster n of the file without following its chain,
+// nCur is the index of curCluster_ or 0XFFFFFFFF if there is none
+bool SdBaseFile::seekCluster(uint32_t n, uint32_t nCur) {
+  uint8_t i;
+  uint32_t k;
+  if (!(flags_ & F_FILE_CONTIGUOUS) && vol_->runFile_ != firstCluster_) {
+    if (!mapRuns()) goto fail;
+  }
+  if (flags_ & F_FILE_CONTIGUOUS) {
+    curCluster_ = firstCluster_ + n;
+    return true;
+  }
+  i = vol_->runCount_ - 1;
+  if (n >= vol_->runEnd_) {
+    // on from the last cluster of the runs or the current one if further
+    k = vol_->runEnd_ - 1;
+    if (nCur != 0XFFFFFFFF && nCur > k && nCur <= n) {
+      k = nCur;
+    } else {
+      curCluster_ = vol_->runCluster_[i] + k - vol_->runStart_[i];
+    }
+    for (n -= k; n; n--) {
+      if (!vol_->fatGet(curCluster_, &curCluster_)) goto fail;
+    }
+    return true;
+  }
+  while (vol_->runStart_[i] > n) i--;
+  curCluster_ = vol_->runCluster_[i] + n - vol_->runStart_[i];
+  return true;
+
+ fail:
+  return false;
+}
+#endif  // SD_SEEK_RUNS
+//------------------------------------------------------------------------------
 void SdBaseFile::setpos(f_pos_t* pos) {
   curPosition_ = pos->position;
   curCluster_ = pos->cluster;
@@ -1671,14 +1891,17 @@ bool SdBaseFile::truncate(uint32_t length) {
   // error if length is greater than current size
   if (length > fileSize_) goto fail;
 
-  // fileSize and length are zero - nothing to do
-  if (fileSize_ == 0) return true;
+  // fileSize and length are zero and no clusters reserved - nothing to do
+  if (fileSize_ == 0 && firstCluster_ == 0) return true;
 
   // remember position for seek after truncation
   newPos = curPosition_ > length ? length : curPosition_;
 
   // position to last cluster in truncated file
   if (!seekSet(length)) goto fail;
+#ifdef SD_SEEK_RUNS
+  seekRunsClear();
+#endif  // SD_SEEK_RUNS
 
   if (length == 0) {
     // free all clusters
@@ -1772,18 +1995,13 @@ int16_t SdBaseFile::write(const void* buf, uint16_t nbyte) {
     // block for data write
     uint32_t block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
     if (n == 512) {
-      // full block - don't need to use cache
-      if (vol_->cacheBlockNumber() == block) {
-        // invalidate cache if block is in cache
-        vol_->cacheSetBlockNumber(0XFFFFFFFF, false);
-      }
+      // full block - don't need to use cache, writeBlock() drops a cached copy
       if (!vol_->writeBlock(block, src)) goto fail;
     } else {
       if (blockOffset == 0 && curPosition_ >= fileSize_) {
         // start of new block don't need to read into cache
-        if (!vol_->cacheFlush()) goto fail;
         // set cache dirty and SD address of block
-        vol_->cacheSetBlockNumber(block, true);
+        if (!vol_->cacheSetBlock(block, SdVolume::CACHE_TYPE_DATA)) goto fail;
       } else {
         // rewrite part of block
         if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) goto fail;
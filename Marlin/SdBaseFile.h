@@ -283,12 +283,14 @@ class SdBaseFile {
   bool printName();
   int16_t read();
   int16_t read(void* buf, uint16_t nbyte);
+  int16_t readLine(char* buf, uint16_t nbyte);
   int8_t readDir(dir_t* dir, char* longFilename);
   static bool remove(SdBaseFile* dirFile, const char* path);
   bool remove();
   /** Set the file's current position to zero. */
   void rewind() {seekSet(0);}
   bool rename(SdBaseFile* dirFile, const char* newPath);
+  bool reserve(uint32_t size);
   bool rmdir();
   // for backward compatibility
   bool rmDir() {return rmdir();}
@@ -331,6 +333,8 @@ class SdBaseFile {
   // bits defined in flags_
   // should be 0X0F
   static uint8_t const F_OFLAG = (O_ACCMODE | O_APPEND | O_SYNC);
+  // file is one run of clusters, set by seekCluster()
+  static uint8_t const F_FILE_CONTIGUOUS = 0X40;
   // sync of directory entry required
   static uint8_t const F_FILE_DIR_DIRTY = 0X80;
 
@@ -358,6 +362,15 @@ class SdBaseFile {
   bool open(SdBaseFile* dirFile, const uint8_t dname[11], uint8_t oflag);
   bool openCachedEntry(uint8_t cacheIndex, uint8_t oflags);
   dir_t* readDirCache();
+#ifdef SD_SEEK_RUNS
+  bool mapRuns();
+  bool seekCluster(uint32_t n, uint32_t nCur);
+  // the cluster chain changes, forget what seekCluster() found out about it
+  void seekRunsClear() {
+    flags_ &= ~F_FILE_CONTIGUOUS;
+    if (vol_->runFile_ == firstCluster_) vol_->runClear();
+  }
+#endif  // SD_SEEK_RUNS
 //------------------------------------------------------------------------------
 // to be deleted
   static void printDirName( const dir_t& dir,
@@ -66,6 +66,8 @@ uint8_t const CMD38 = 0X26;
 uint8_t const CMD55 = 0X37;
 /** READ_OCR - read the OCR register of a card */
 uint8_t const CMD58 = 0X3A;
+/** CRC_ON_OFF - turn the card's CRC check of commands and data on or off */
+uint8_t const CMD59 = 0X3B;
 /** SET_WR_BLK_ERASE_COUNT - Set the number of write blocks to be
      pre-erased before writing */
 uint8_t const ACMD23 = 0X17;
@@ -89,6 +91,8 @@ uint8_t const WRITE_MULTIPLE_TOKEN = 0XFC;
 uint8_t const DATA_RES_MASK = 0X1F;
 /** write data accepted token */
 uint8_t const DATA_RES_ACCEPTED = 0X05;
+/** write data rejected for a CRC error token */
+uint8_t const DATA_RES_CRC_ERROR = 0X0B;
 //------------------------------------------------------------------------------
 /** Card IDentification (CID) register */
 typedef struct CID {
@@ -24,12 +24,28 @@
 //------------------------------------------------------------------------------
 #if !USE_MULTIPLE_CARDS
 // raw block cache
-uint32_t SdVolume::cacheBlockNumber_;  // current block number
-cache_t  SdVolume::cacheBuffer_;       // 512 byte cache for Sd2Card
+uint32_t SdVolume::cacheBlockNumber_[SD_CACHE_SLOTS];  // block number per slot
+cache_t  SdVolume::cacheBuffer_[SD_CACHE_SLOTS];       // 512 byte slots for Sd2Card
 Sd2Card* SdVolume::sdCard_;            // pointer to SD card object
-bool     SdVolume::cacheDirty_;        // cacheFlush() will write block if true
-uint32_t SdVolume::cacheMirrorBlock_;  // mirror  block for second FAT
+uint8_t  SdVolume::cacheDirty_;        // bit per slot, cacheFlush() writes those
+uint32_t SdVolume::cacheMirrorBlock_[SD_CACHE_SLOTS];  // mirror block for second FAT
+uint8_t  SdVolume::cacheUse_[SD_CACHE_SLOTS];  // cacheTick_ of the last use
+uint8_t  SdVolume::cacheSlot_;         // slot of the block cache() points at
+uint8_t  SdVolume::cacheTick_;
 #endif  // USE_MULTIPLE_CARDS
+uint32_t SdVolume::cacheHits_[3];
+uint32_t SdVolume::cacheMisses_[3];
+#ifdef SD_READ_AHEAD
+cache_t  SdVolume::readAheadBuffer_[2];
+uint32_t SdVolume::readAheadBlock_[2] = {0XFFFFFFFF, 0XFFFFFFFF};
+#endif  // SD_READ_AHEAD
+#ifdef SD_SEEK_RUNS
+uint32_t SdVolume::runFile_;
+uint8_t  SdVolume::runCount_;
+uint32_t SdVolume::runEnd_;
+uint32_t SdVolume::runStart_[SD_SEEK_RUNS];
+uint32_t SdVolume::runCluster_[SD_SEEK_RUNS];
+#endif  // SD_SEEK_RUNS
 //------------------------------------------------------------------------------
 // find a contiguous group of clusters
 bool SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
@@ -104,19 +120,38 @@ bool SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
   return false;
 }
 //------------------------------------------------------------------------------
+// write the dirty slots: file data, then the FAT, then directory entries
 bool SdVolume::cacheFlush() {
-  if (cacheDirty_) {
-    if (!sdCard_->writeBlock(cacheBlockNumber_, cacheBuffer_.data)) {
+#if SD_CACHE_SLOTS == 1
+  return cacheFlushSlot(0);
+#else  // SD_CACHE_SLOTS
+  for (uint8_t i = 2; i < SD_CACHE_SLOTS; i++) {
+    if (!cacheFlushSlot(i)) goto fail;
+  }
+  if (!cacheFlushSlot(0)) goto fail;
+  return cacheFlushSlot(1);
+
+ fail:
+  return false;
+#endif  // SD_CACHE_SLOTS
+}
+//------------------------------------------------------------------------------
+bool SdVolume::cacheFlushSlot(uint8_t i) {
+  if (cacheDirty_ & (1 << i)) {
+#ifdef SD_READ_AHEAD
+    readAheadClear();
+#endif  // SD_READ_AHEAD
+    if (!sdCard_->writeBlock(cacheBlockNumber_[i], cacheBuffer_[i].data)) {
       goto fail;
     }
     // mirror FAT tables
-    if (cacheMirrorBlock_) {
-      if (!sdCard_->writeBlock(cacheMirrorBlock_, cacheBuffer_.data)) {
+    if (cacheMirrorBlock_[i]) {
+      if (!sdCard_->writeBlock(cacheMirrorBlock_[i], cacheBuffer_[i].data)) {
         goto fail;
       }
-      cacheMirrorBlock_ = 0;
+      cacheMirrorBlock_[i] = 0;
     }
-    cacheDirty_ = 0;
+    cacheDirty_ &= ~(1 << i);
   }
   return true;
 
@@ -124,19 +159,117 @@ bool SdVolume::cacheFlush() {
   return false;
 }
 //------------------------------------------------------------------------------
-bool SdVolume::cacheRawBlock(uint32_t blockNumber, bool dirty) {
-  if (cacheBlockNumber_ != blockNumber) {
-    if (!cacheFlush()) goto fail;
-    if (!sdCard_->readBlock(blockNumber, cacheBuffer_.data)) goto fail;
-    cacheBlockNumber_ = blockNumber;
+// slot holding blockNumber, -1 if none
+int8_t SdVolume::cacheFind(uint32_t blockNumber) {
+  for (uint8_t i = 0; i < SD_CACHE_SLOTS; i++) {
+    if (cacheBlockNumber_[i] == blockNumber) return i;
+  }
+  return -1;
+}
+//------------------------------------------------------------------------------
+// CACHE_TYPE of blockNumber, type unless it is in the FAT or FAT16 root
+uint8_t SdVolume::cacheType(uint32_t blockNumber, uint8_t type) {
+  if (blockNumber >= fatStartBlock_ &&
+      blockNumber < fatStartBlock_ + fatCount_ * blocksPerFat_) {
+    return CACHE_TYPE_FAT;
+  }
+  if (type == CACHE_TYPE_DIR ||
+      (fatType_ == 16 && blockNumber >= rootDirStart_ &&
+       blockNumber < dataStartBlock_)) {
+    return CACHE_TYPE_DIR;
+  }
+  return CACHE_TYPE_DATA;
+}
+//------------------------------------------------------------------------------
+// FAT and directory blocks have a slot each, file data takes the least
+// recently used of the others. With one slot everything shares it.
+uint8_t SdVolume::cacheVictim(uint8_t type) {
+#if SD_CACHE_SLOTS == 1
+  return 0;
+#else  // SD_CACHE_SLOTS
+  if (type != CACHE_TYPE_DATA) return type;
+  uint8_t victim = 2;
+  for (uint8_t i = 3; i < SD_CACHE_SLOTS; i++) {
+    if ((uint8_t)(cacheTick_ - cacheUse_[i]) >
+        (uint8_t)(cacheTick_ - cacheUse_[victim])) {
+      victim = i;
+    }
+  }
+  return victim;
+#endif  // SD_CACHE_SLOTS
+}
+//------------------------------------------------------------------------------
+bool SdVolume::cacheRawBlock(uint32_t blockNumber, bool dirty, uint8_t type) {
+  int8_t i = cacheFind(blockNumber);
+  type = cacheType(blockNumber, type);
+  if (i < 0) {
+    cacheMisses_[type]++;
+    i = cacheVictim(type);
+    if (!cacheFlushSlot(i)) goto fail;
+    cacheBlockNumber_[i] = 0XFFFFFFFF;
+    if (!sdCard_->readBlock(blockNumber, cacheBuffer_[i].data)) goto fail;
+    cacheBlockNumber_[i] = blockNumber;
+  } else {
+    cacheHits_[type]++;
   }
-  if (dirty) cacheDirty_ = true;
+  cacheSlot_ = i;
+  cacheUse_[i] = ++cacheTick_;
+  if (dirty) cacheDirty_ |= 1 << i;
   return true;
 
  fail:
   return false;
 }
 //------------------------------------------------------------------------------
+// give blockNumber a slot without reading it, the caller fills all of it
+bool SdVolume::cacheSetBlock(uint32_t blockNumber, uint8_t type) {
+  int8_t i = cacheFind(blockNumber);
+  if (i < 0) {
+    i = cacheVictim(cacheType(blockNumber, type));
+    if (!cacheFlushSlot(i)) return false;
+  }
+  cacheBlockNumber_[i] = blockNumber;
+  cacheSlot_ = i;
+  cacheUse_[i] = ++cacheTick_;
+  cacheDirty_ |= 1 << i;
+  return true;
+}
+//------------------------------------------------------------------------------
+// forget a cached copy of a block written to the card past the cache
+void SdVolume::cacheInvalidate(uint32_t blockNumber) {
+  int8_t i = cacheFind(blockNumber);
+  if (i < 0) return;
+  cacheBlockNumber_[i] = 0XFFFFFFFF;
+  cacheDirty_ &= ~(1 << i);
+  cacheMirrorBlock_[i] = 0;
+}
+//------------------------------------------------------------------------------
+void SdVolume::cacheStatsClear() {
+  for (uint8_t i = 0; i < 3; i++) cacheHits_[i] = cacheMisses_[i] = 0;
+}
+//------------------------------------------------------------------------------
+#ifdef SD_READ_AHEAD
+// File data block through the read-ahead buffers. A miss streams the block
+// and, when it is in the same cluster, the one after it, so reading on
+// through the file mostly finds its next block already there.
+uint8_t* SdVolume::readAhead(uint32_t block) {
+  if (readAheadBlock_[0] == block) return readAheadBuffer_[0].data;
+  if (readAheadBlock_[1] == block) return readAheadBuffer_[1].data;
+  // written and not flushed yet
+  int8_t i = cacheFind(block);
+  if (i >= 0) return cacheBuffer_[i].data;
+
+  readAheadClear();
+  if (!sdCard_->readStream(block, readAheadBuffer_[0].data)) return 0;
+  readAheadBlock_[0] = block;
+  if (((block + 1 - dataStartBlock_) & (blocksPerCluster_ - 1)) != 0 &&
+      sdCard_->readStream(block + 1, readAheadBuffer_[1].data)) {
+    readAheadBlock_[1] = block + 1;
+  }
+  return readAheadBuffer_[0].data;
+}
+#endif  // SD_READ_AHEAD
+//------------------------------------------------------------------------------
 // return the size in bytes of a cluster chain
 bool SdVolume::chainSize(uint32_t cluster, uint32_t* size) {
   uint32_t s = 0;
@@ -161,13 +294,13 @@ bool SdVolume::fatGet(uint32_t cluster, uint32_t* value) {
     lba = fatStartBlock_ + (index >> 9);
     if (!cacheRawBlock(lba, CACHE_FOR_READ)) goto fail;
     index &= 0X1FF;
-    uint16_t tmp = cacheBuffer_.data[index];
+    uint16_t tmp = cache()->data[index];
     index++;
     if (index == 512) {
       if (!cacheRawBlock(lba + 1, CACHE_FOR_READ)) goto fail;
       index = 0;
     }
-    tmp |= cacheBuffer_.data[index] << 8;
+    tmp |= cache()->data[index] << 8;
     *value = cluster & 1 ? tmp >> 4 : tmp & 0XFFF;
     return true;
   }
@@ -178,13 +311,11 @@ bool SdVolume::fatGet(uint32_t cluster, uint32_t* value) {
   } else {
     goto fail;
   }
-  if (lba != cacheBlockNumber_) {
-    if (!cacheRawBlock(lba, CACHE_FOR_READ)) goto fail;
-  }
+  if (!cacheRawBlock(lba, CACHE_FOR_READ)) goto fail;
   if (fatType_ == 16) {
-    *value = cacheBuffer_.fat16[cluster & 0XFF];
+    *value = cache()->fat16[cluster & 0XFF];
   } else {
-    *value = cacheBuffer_.fat32[cluster & 0X7F] & FAT32MASK;
+    *value = cache()->fat32[cluster & 0X7F] & FAT32MASK;
   }
   return true;
 
@@ -207,26 +338,26 @@ bool SdVolume::fatPut(uint32_t cluster, uint32_t value) {
     lba = fatStartBlock_ + (index >> 9);
     if (!cacheRawBlock(lba, CACHE_FOR_WRITE)) goto fail;
     // mirror second FAT
-    if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
+    if (fatCount_ > 1) cacheMirrorBlock_[cacheSlot_] = lba + blocksPerFat_;
     index &= 0X1FF;
     uint8_t tmp = value;
     if (cluster & 1) {
-      tmp = (cacheBuffer_.data[index] & 0XF) | tmp << 4;
+      tmp = (cache()->data[index] & 0XF) | tmp << 4;
     }
-    cacheBuffer_.data[index] = tmp;
+    cache()->data[index] = tmp;
     index++;
     if (index == 512) {
       lba++;
       index = 0;
       if (!cacheRawBlock(lba, CACHE_FOR_WRITE)) goto fail;
       // mirror second FAT
-      if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
+      if (fatCount_ > 1) cacheMirrorBlock_[cacheSlot_] = lba + blocksPerFat_;
     }
     tmp = value >> 4;
     if (!(cluster & 1)) {
-      tmp = ((cacheBuffer_.data[index] & 0XF0)) | tmp >> 4;
+      tmp = ((cache()->data[index] & 0XF0)) | tmp >> 4;
     }
-    cacheBuffer_.data[index] = tmp;
+    cache()->data[index] = tmp;
     return true;
   }
   if (fatType_ == 16) {
@@ -239,12 +370,12 @@ bool SdVolume::fatPut(uint32_t cluster, uint32_t value) {
   if (!cacheRawBlock(lba, CACHE_FOR_WRITE)) goto fail;
   // store entry
   if (fatType_ == 16) {
-    cacheBuffer_.fat16[cluster & 0XFF] = value;
+    cache()->fat16[cluster & 0XFF] = value;
   } else {
-    cacheBuffer_.fat32[cluster & 0X7F] = value;
+    cache()->fat32[cluster & 0X7F] = value;
   }
   // mirror second FAT
-  if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
+  if (fatCount_ > 1) cacheMirrorBlock_[cacheSlot_] = lba + blocksPerFat_;
   return true;
 
  fail:
@@ -296,11 +427,11 @@ int32_t SdVolume::freeClusterCount() {
     if (todo < n) n = todo;
     if (fatType_ == 16) {
       for (uint16_t i = 0; i < n; i++) {
-        if (cacheBuffer_.fat16[i] == 0) free++;
+        if (cache()->fat16[i] == 0) free++;
       }
     } else {
       for (uint16_t i = 0; i < n; i++) {
-        if (cacheBuffer_.fat32[i] == 0) free++;
+        if (cache()->fat32[i] == 0) free++;
       }
     }
   }
@@ -330,15 +461,24 @@ bool SdVolume::init(Sd2Card* dev, uint8_t part) {
   fatType_ = 0;
   allocSearchStart_ = 2;
   cacheDirty_ = 0;  // cacheFlush() will write block if true
-  cacheMirrorBlock_ = 0;
-  cacheBlockNumber_ = 0XFFFFFFFF;
+  for (uint8_t i = 0; i < SD_CACHE_SLOTS; i++) {
+    cacheMirrorBlock_[i] = 0;
+    cacheBlockNumber_[i] = 0XFFFFFFFF;
+  }
+  cacheSlot_ = 0;
+#ifdef SD_READ_AHEAD
+  readAheadClear();
+#endif  // SD_READ_AHEAD
+#ifdef SD_SEEK_RUNS
+  runClear();
+#endif  // SD_SEEK_RUNS
 
   // if part == 0 assume super floppy with FAT boot sector in block zero
   // if part > 0 assume mbr volume with partition table
   if (part) {
     if (part > 4)goto fail;
     if (!cacheRawBlock(volumeStartBlock, CACHE_FOR_READ)) goto fail;
-    part_t* p = &cacheBuffer_.mbr.part[part-1];
+    part_t* p = &cache()->mbr.part[part-1];
     if ((p->boot & 0X7F) !=0  ||
       p->totalSectors < 100 ||
       p->firstSector == 0) {
@@ -348,7 +488,7 @@ bool SdVolume::init(Sd2Card* dev, uint8_t part) {
     volumeStartBlock = p->firstSector;
   }
   if (!cacheRawBlock(volumeStartBlock, CACHE_FOR_READ)) goto fail;
-  fbs = &cacheBuffer_.fbs32;
+  fbs = &cache()->fbs32;
   if (fbs->bytesPerSector != 512 ||
     fbs->fatCount == 0 ||
     fbs->reservedSectorCount == 0 ||
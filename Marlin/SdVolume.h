@@ -29,6 +29,13 @@
 #include "Sd2Card.h"
 #include "SdFatStructs.h"
 
+#ifndef SD_CACHE_SLOTS
+#define SD_CACHE_SLOTS 1
+#endif
+#if (SD_CACHE_SLOTS < 3 && SD_CACHE_SLOTS != 1) || SD_CACHE_SLOTS > 8
+#error SD_CACHE_SLOTS must be 1 or 3 to 8
+#endif
+
 //==============================================================================
 // SdVolume class
 /**
@@ -67,8 +74,8 @@ class SdVolume {
    */
   cache_t* cacheClear() {
     if (!cacheFlush()) return 0;
-    cacheBlockNumber_ = 0XFFFFFFFF;
-    return &cacheBuffer_;
+    cacheBlockNumber_[cacheSlot_] = 0XFFFFFFFF;
+    return &cacheBuffer_[cacheSlot_];
   }
   /** Initialize a FAT volume.  Try partition one first then try super
    * floppy format.
@@ -117,6 +124,25 @@ class SdVolume {
    * \return true for success or false for failure
    */
   bool dbgFat(uint32_t n, uint32_t* v) {return fatGet(n, v);}
+
+  // kinds of cached block, for the slot they go to and the counters
+  static uint8_t const CACHE_TYPE_FAT = 0;
+  static uint8_t const CACHE_TYPE_DIR = 1;
+  static uint8_t const CACHE_TYPE_DATA = 2;
+  /** \return Blocks of a CACHE_TYPE found in the cache. */
+  static uint32_t cacheHits(uint8_t type) {return cacheHits_[type];}
+  /** \return Blocks of a CACHE_TYPE that had to be read from the card. */
+  static uint32_t cacheMisses(uint8_t type) {return cacheMisses_[type];}
+  static void cacheStatsClear();
+#ifdef SD_READ_AHEAD
+  /** \return The first read-ahead block, for a file written instead of
+   * printed to use as a buffer until readLine() is called again.
+   */
+  static uint8_t* readAheadLend() {
+    readAheadClear();
+    return readAheadBuffer_[0].data;
+  }
+#endif  // SD_READ_AHEAD
 //------------------------------------------------------------------------------
  private:
   // Allow SdBaseFile access to SdVolume private data.
@@ -128,18 +154,26 @@ class SdVolume {
   static bool const CACHE_FOR_WRITE = true;
 
 #if USE_MULTIPLE_CARDS
-  cache_t cacheBuffer_;        // 512 byte cache for device blocks
-  uint32_t cacheBlockNumber_;  // Logical number of block in the cache
+  cache_t cacheBuffer_[SD_CACHE_SLOTS];        // 512 byte slots for device blocks
+  uint32_t cacheBlockNumber_[SD_CACHE_SLOTS];  // Logical number of block in each slot
   Sd2Card* sdCard_;            // Sd2Card object for cache
-  bool cacheDirty_;            // cacheFlush() will write block if true
-  uint32_t cacheMirrorBlock_;  // block number for mirror FAT
+  uint8_t cacheDirty_;         // bit per slot, cacheFlush() writes those
+  uint32_t cacheMirrorBlock_[SD_CACHE_SLOTS];  // block number for mirror FAT
+  uint8_t cacheUse_[SD_CACHE_SLOTS];  // cacheTick_ of the last use, for LRU
+  uint8_t cacheSlot_;          // slot of the block cache() points at
+  uint8_t cacheTick_;
 #else  // USE_MULTIPLE_CARDS
-  static cache_t cacheBuffer_;        // 512 byte cache for device blocks
-  static uint32_t cacheBlockNumber_;  // Logical number of block in the cache
+  static cache_t cacheBuffer_[SD_CACHE_SLOTS];        // 512 byte slots for device blocks
+  static uint32_t cacheBlockNumber_[SD_CACHE_SLOTS];  // Logical number of block in each slot
   static Sd2Card* sdCard_;            // Sd2Card object for cache
-  static bool cacheDirty_;            // cacheFlush() will write block if true
-  static uint32_t cacheMirrorBlock_;  // block number for mirror FAT
+  static uint8_t cacheDirty_;         // bit per slot, cacheFlush() writes those
+  static uint32_t cacheMirrorBlock_[SD_CACHE_SLOTS];  // block number for mirror FAT
+  static uint8_t cacheUse_[SD_CACHE_SLOTS];  // cacheTick_ of the last use, for LRU
+  static uint8_t cacheSlot_;          // slot of the block cache() points at
+  static uint8_t cacheTick_;
 #endif  // USE_MULTIPLE_CARDS
+  static uint32_t cacheHits_[3];    // per CACHE_TYPE
+  static uint32_t cacheMisses_[3];
   uint32_t allocSearchStart_;   // start cluster for alloc search
   uint8_t blocksPerCluster_;    // cluster size in blocks
   uint32_t blocksPerFat_;       // FAT size in blocks
@@ -159,21 +193,45 @@ class SdVolume {
            return dataStartBlock_ + ((cluster - 2) << clusterSizeShift_);}
   uint32_t blockNumber(uint32_t cluster, uint32_t position) const {
            return clusterStartBlock(cluster) + blockOfCluster(position);}
-  cache_t *cache() {return &cacheBuffer_;}
-  uint32_t cacheBlockNumber() {return cacheBlockNumber_;}
+  cache_t *cache() {return &cacheBuffer_[cacheSlot_];}
+  uint32_t cacheBlockNumber() {return cacheBlockNumber_[cacheSlot_];}
+#ifdef SD_READ_AHEAD
+  // print file data, streamed into its own two blocks apart from the FAT/dir cache
+  static cache_t readAheadBuffer_[2];
+  static uint32_t readAheadBlock_[2];
+  uint8_t* readAhead(uint32_t block);
+  static void readAheadClear() {
+    readAheadBlock_[0] = readAheadBlock_[1] = 0XFFFFFFFF;
+  }
+#endif  // SD_READ_AHEAD
+#ifdef SD_SEEK_RUNS
+  // runs of consecutive clusters of the last fragmented file seeked in
+  static uint32_t runFile_;                   // its first cluster, 0 if none
+  static uint8_t runCount_;
+  static uint32_t runEnd_;                    // clusters of the file the runs cover
+  static uint32_t runStart_[SD_SEEK_RUNS];    // cluster index in the file of each run
+  static uint32_t runCluster_[SD_SEEK_RUNS];  // first cluster of each run
+  static void runClear() {runFile_ = 0;}
+#endif  // SD_SEEK_RUNS
 #if USE_MULTIPLE_CARDS
   bool cacheFlush();
-  bool cacheRawBlock(uint32_t blockNumber, bool dirty);
+  bool cacheFlushSlot(uint8_t i);
+  int8_t cacheFind(uint32_t blockNumber);
+  void cacheInvalidate(uint32_t blockNumber);
 #else  // USE_MULTIPLE_CARDS
   static bool cacheFlush();
-  static bool cacheRawBlock(uint32_t blockNumber, bool dirty);
+  static bool cacheFlushSlot(uint8_t i);
+  static int8_t cacheFind(uint32_t blockNumber);
+  static void cacheInvalidate(uint32_t blockNumber);
 #endif  // USE_MULTIPLE_CARDS
+  // the slot a block goes to depends on where it is on this volume
+  bool cacheRawBlock(uint32_t blockNumber, bool dirty,
+                     uint8_t type = CACHE_TYPE_DATA);
   // used by SdBaseFile write to assign cache to SD location
-  void cacheSetBlockNumber(uint32_t blockNumber, bool dirty) {
-    cacheDirty_ = dirty;
-    cacheBlockNumber_  = blockNumber;
-  }
-  void cacheSetDirty() {cacheDirty_ |= CACHE_FOR_WRITE;}
+  bool cacheSetBlock(uint32_t blockNumber, uint8_t type);
+  uint8_t cacheType(uint32_t blockNumber, uint8_t type);
+  uint8_t cacheVictim(uint8_t type);
+  void cacheSetDirty() {cacheDirty_ |= 1 << cacheSlot_;}
   bool chainSize(uint32_t beginCluster, uint32_t* size);
   bool fatGet(uint32_t cluster, uint32_t* value);
   bool fatPut(uint32_t cluster, uint32_t value);
@@ -189,6 +247,10 @@ class SdVolume {
   bool readBlock(uint32_t block, uint8_t* dst) {
     return sdCard_->readBlock(block, dst);}
   bool writeBlock(uint32_t block, const uint8_t* dst) {
+#ifdef SD_READ_AHEAD
+    readAheadClear();
+#endif  // SD_READ_AHEAD
+    cacheInvalidate(block);
     return sdCard_->writeBlock(block, dst);
   }
 //------------------------------------------------------------------------------
@@ -4,9 +4,39 @@
 #include "temperature.h"
 #include "language.h"
 #include "ConfigurationStore.h"
+#include "parse_number.h"
 
 #ifdef SDSUPPORT
 
+#ifdef SD_LAYER_INDEX
+#define LAYER_NONE 0
+#define LAYER_TAIL 1      // layerIn is read from META_TAIL before its end for slicer totals, then scanned
+#define LAYER_SCAN 2      // layerIn is read on into layerFile
+#define LAYER_DONE 3      // layerFile holds layerCount layers
+#define LAYER_MIN_STEP 0.05 // smaller rises are not a new layer, so vase mode gets one entry per LAYER_MIN_STEP
+#ifdef SD_FILE_META
+#define LAYER_MAGIC "LYM1"  // the head carries file_meta_t
+#define META_TAIL 32768     // bytes at the end of a file read for slicer totals before it is scanned
+#else
+#define LAYER_MAGIC "LYR1"
+#endif
+
+//Head of a layer index file, layerCount layer_t follow it
+struct layer_head_t
+{
+    char magic[4];
+    uint32_t size; // size and write time of the print file it was built from
+    uint16_t date;
+    uint16_t time;
+    uint16_t count;
+    uint8_t done; // the whole file was scanned
+    uint8_t pad;
+#ifdef SD_FILE_META
+    file_meta_t meta;
+#endif
+};
+#endif
+
 CardReader::CardReader()
 {
     filesize = 0;
@@ -14,10 +44,23 @@ CardReader::CardReader()
     sdprinting = 0;
     cardOK = false;
     saving = false;
+    writing = false;
     logging = false;
     autostart_atmillis = 0;
     workDirDepth = 0;
     memset(workDirParents, 0, sizeof(workDirParents));
+#ifdef SD_DIR_INDEX_SIZE
+    dirIndexClear();
+#endif
+#ifdef SD_LAYER_INDEX
+    layerState = LAYER_NONE;
+#endif
+#ifdef SD_WRITE_BUFFER
+    writeLen = writeDone = 0;
+#ifdef SD_WRITE_RESERVE
+    writeTrim = false;
+#endif
+#endif
 
     autostart_stilltocheck = true; //the sd start is delayed, because otherwise the serial cannot answer fast enought to make contact with the hostsoftware.
     lastnr = 0;
@@ -50,11 +93,12 @@ char *createFilename(char *buffer, const dir_t &p) //buffer>12characters
 void CardReader::lsDive(const char *prepend, SdFile parent)
 {
     dir_t p;
-    uint8_t cnt = 0;
+    uint16_t cnt = 0;
 
-    while (parent.readDir(p, longFilename) > 0)
+    //pos is where the entry starts, with its long name parts
+    for (uint32_t pos = parent.curPosition(); parent.readDir(p, longFilename) > 0; pos = parent.curPosition())
     {
-        if (DIR_IS_SUBDIR(&p) && lsAction != LS_Count && lsAction != LS_GetFilename) // hence LS_SerialPrint
+        if (DIR_IS_SUBDIR(&p) && lsAction != LS_Count && lsAction != LS_GetFilename && lsAction != LS_Sort) // hence LS_SerialPrint
         {
 
             char path[13 * 2];
@@ -120,8 +164,17 @@ void CardReader::lsDive(const char *prepend, SdFile parent)
             }
             else if (lsAction == LS_Count)
             {
+#ifdef SD_DIR_INDEX_SIZE
+                dirIndexAdd(pos >> 5);
+#endif
                 nrFiles++;
             }
+#ifdef SD_SORT_NEWEST_FIRST
+            else if (lsAction == LS_Sort)
+            {
+                sortAdd(p, pos >> 5);
+            }
+#endif
             else if (lsAction == LS_GetFilename)
             {
                 if (cnt == nrFiles)
@@ -149,6 +202,9 @@ void CardReader::initsd()
     cardOK = false;
     if (root.isOpen())
         root.close();
+#ifdef SD_LAYER_INDEX
+    layerIndexStop();
+#endif
 #ifdef SDSLOW
     if (!card.init(SPI_HALF_SPEED, SDSS))
 #else
@@ -180,6 +236,9 @@ void CardReader::initsd()
         cardOK = true;
         SERIAL_ECHO_START;
         SERIAL_ECHOLNPGM(MSG_SD_CARD_OK);
+#ifdef SD_LAYER_INDEX
+        layerIndexTidy();
+#endif
 #ifdef TL_TJC_CONTROLLER
         TenlogScreen_println("tStatus.txt=\"SD card OK\"");
 #endif
@@ -189,6 +248,9 @@ void CardReader::initsd()
     }
     workDir = root;
     curDir = &root;
+#ifdef SD_DIR_INDEX_SIZE
+    dirIndexClear();
+#endif
     /*
     if(!workDir.openRoot(&volume))
     {
@@ -206,6 +268,9 @@ void CardReader::setroot()
     workDir = root;
 
     curDir = &workDir;
+#ifdef SD_DIR_INDEX_SIZE
+    dirIndexClear();
+#endif
 }
 void CardReader::release()
 {
@@ -233,10 +298,27 @@ void CardReader::openLogFile(char *name)
     openFile(name, name, false); //By zyf
 }
 
+bool CardReader::openRootFile(SdFile &f, const char *name, uint8_t oflag)
+{
+    if (!cardOK)
+        return false;
+#ifdef SD_DIR_INDEX_SIZE
+    if (oflag & O_CREAT)
+        dirIndexClear();
+#endif
+    return f.open(&root, name, oflag);
+}
+
 void CardReader::openFile(char *lngName, char *name, bool read, uint32_t startPos) //By zyf
 {
     if (!cardOK)
         return;
+#ifdef SD_LAYER_INDEX
+    layerIndexStop();
+#endif
+#ifdef SD_WRITE_BUFFER
+    writeClose();
+#endif
     file.close();
     sdprinting = 0;
 
@@ -317,6 +399,9 @@ void CardReader::openFile(char *lngName, char *name, bool read, uint32_t startPo
 #else
             sdpos = 0;
 #endif
+#ifdef SD_LAYER_INDEX
+            layerIndexOpen();
+#endif
 
             SERIAL_PROTOCOLLNPGM(MSG_SD_FILE_SELECTED);
             //lcd_setstatus(fname);
@@ -344,6 +429,9 @@ void CardReader::openFile(char *lngName, char *name, bool read, uint32_t startPo
     }
     else
     { //write
+#ifdef SD_DIR_INDEX_SIZE
+        dirIndexClear();
+#endif
         if (!file.open(curDir, fname, O_CREAT | O_APPEND | O_WRITE | O_TRUNC))
         {
             SERIAL_PROTOCOLPGM(MSG_SD_OPEN_FILE_FAIL);
@@ -353,6 +441,10 @@ void CardReader::openFile(char *lngName, char *name, bool read, uint32_t startPo
         else
         {
             saving = true;
+            writing = true;
+#ifdef SD_WRITE_BUFFER
+            writeOpen();
+#endif
             SERIAL_PROTOCOLPGM(MSG_SD_WRITE_TO_FILE);
             SERIAL_PROTOCOLLN(name);
             //lcd_setstatus(fname);
@@ -364,6 +456,12 @@ void CardReader::removeFile(char *name)
 {
     if (!cardOK)
         return;
+#ifdef SD_LAYER_INDEX
+    layerIndexStop();
+#endif
+#ifdef SD_WRITE_BUFFER
+    writeClose();
+#endif
     file.close();
     sdprinting = 0;
 
@@ -414,8 +512,22 @@ void CardReader::removeFile(char *name)
     {
         curDir = &workDir;
     }
+#ifdef SD_DIR_INDEX_SIZE
+    dirIndexClear();
+#endif
+#ifdef SD_LAYER_INDEX
+    uint32_t cluster = 0;
+    if (file.open(curDir, fname, O_READ))
+    {
+        cluster = file.firstCluster();
+        file.close();
+    }
+#endif
     if (file.remove(curDir, fname))
     {
+#ifdef SD_LAYER_INDEX
+        layerIndexForget(cluster);
+#endif
         SERIAL_PROTOCOLPGM("File deleted:");
         SERIAL_PROTOCOL(fname);
         sdpos = 0;
@@ -436,12 +548,71 @@ void CardReader::getStatus()
         SERIAL_PROTOCOL(sdpos);
         SERIAL_PROTOCOLPGM("/");
         SERIAL_PROTOCOLLN(filesize);
+#ifdef SD_LAYER_INDEX
+        if (layerState == LAYER_DONE && layerCount)
+        {
+            SERIAL_PROTOCOLPGM("Layer ");
+            SERIAL_PROTOCOL(layerAt(sdpos));
+            SERIAL_PROTOCOLPGM("/");
+            SERIAL_PROTOCOLLN(layerCount);
+        }
+#endif
     }
     else
     {
         SERIAL_PROTOCOLLNPGM(MSG_SD_NOT_PRINTING);
     }
 }
+//M1120: time reading the first blocks of the card, streamed as the print file is and one at a time.
+//Not during a print: the card would stop feeding it for the whole test.
+void CardReader::readSpeed(uint16_t blocks)
+{
+    if (!cardOK || writing)
+        return;
+    if (sdprinting || blocks_queued())
+    {
+        SERIAL_ERROR_START;
+        SERIAL_ERRORLNPGM("Not while printing");
+        return;
+    }
+    cache_t *buf = volume.cacheClear();
+    if (!buf)
+        return;
+    unsigned long us[2];
+    for (uint8_t single = 0; single < 2; single++)
+    {
+        unsigned long t = micros();
+        for (uint16_t b = 0; b < blocks; b++)
+        {
+            if ((b & 63) == 63)
+                manage_heater(); //2048 blocks take seconds, heaters may be on
+            if (!(single ? card.readBlock(b, buf->data) : card.readStream(b, buf->data)))
+            {
+                card.streamStop();
+                SERIAL_ERROR_START;
+                SERIAL_ERRORLNPGM("SD read failed");
+                return;
+            }
+        }
+        us[single] = micros() - t;
+        card.streamStop();
+    }
+    SERIAL_ECHO_START;
+    SERIAL_ECHOPGM("SD read KB/s stream:");
+    SERIAL_ECHO(blocks * 500000UL / us[0]);
+    SERIAL_ECHOPGM(" single:");
+    SERIAL_ECHO(blocks * 500000UL / us[1]);
+    SERIAL_ECHOPGM(" SPI F_CPU/");
+    SERIAL_ECHO(2 << card.spiRate());
+#ifdef SD_CHECK_AND_RETRY
+    if (card.crcCheck())
+        SERIAL_ECHOPGM(" CRC checked");
+    SERIAL_ECHOPGM(" slowdowns:");
+    SERIAL_ECHO((int)card.slowDowns());
+#endif
+    SERIAL_ECHOLN("");
+}
+
 void CardReader::write_command(char *buf)
 {
     char *begin = buf;
@@ -457,7 +628,22 @@ void CardReader::write_command(char *buf)
     end[1] = '\r';
     end[2] = '\n';
     end[3] = '\0';
+#ifdef SD_WRITE_BUFFER
+    uint16_t len = end + 3 - begin;
+    while (len > 0)
+    {
+        uint16_t n = min(len, 512 - writeLen);
+        memcpy(writeBuf + writeLen, begin, n);
+        writeLen += n;
+        begin += n;
+        len -= n;
+        if (writeLen == 512 && !writeFlush())
+            break;
+    }
+    writeSyncStep();
+#else
     file.write(begin);
+#endif
     if (file.writeError)
     {
         SERIAL_ERROR_START;
@@ -465,6 +651,96 @@ void CardReader::write_command(char *buf)
     }
 }
 
+bool CardReader::write_block(const uint8_t *buf, uint16_t len)
+{
+    //whole 512 byte blocks at a block boundary go straight to the card, past the cache
+#ifdef SD_WRITE_RESERVE
+    writeReserve();
+#endif
+    return file.write(buf, len) == (int16_t)len;
+}
+
+#ifdef SD_WRITE_BUFFER
+//file was just opened for writing, empty
+void CardReader::writeOpen()
+{
+#ifdef SD_READ_AHEAD
+    writeBuf = SdVolume::readAheadLend(); //nothing is printed from the card while it is written to
+#else
+    writeBuf = writeBlock;
+#endif
+    writeLen = writeDone = 0;
+    writeSyncMs = millis();
+#ifdef SD_WRITE_RESERVE
+    writeReserveEnd = logging ? 0xFFFFFFFF : 0; //a log stays small, no clusters to spare for it
+    writeTrim = false;
+#endif
+}
+
+//Write what is buffered to file: a full block goes to the card in one piece, a part of one through the cache
+bool CardReader::writeFlush()
+{
+    if (writeLen > writeDone)
+    {
+#ifdef SD_WRITE_RESERVE
+        writeReserve();
+#endif
+        if (file.write(writeBuf + writeDone, writeLen - writeDone) < 0)
+            return false;
+    }
+    if (writeLen == 512)
+        writeLen = 0;
+    writeDone = writeLen;
+    return true;
+}
+
+void CardReader::writeSyncStep()
+{
+    if (!writing || millis() - writeSyncMs < SD_WRITE_SYNC_MS)
+        return;
+    writeSyncMs = millis();
+    if (!writeFlush() || !file.sync())
+    {
+        SERIAL_ERROR_START;
+        SERIAL_ERRORLNPGM(MSG_SD_ERR_WRITE_TO_FILE);
+    }
+}
+
+//Before file is closed: the rest of the buffer and the reserved clusters not used
+void CardReader::writeClose()
+{
+    if (!file.isOpen())
+        return;
+    writeFlush();
+    writeLen = writeDone = 0;
+#ifdef SD_WRITE_RESERVE
+    if (writeTrim)
+        file.truncate(file.fileSize());
+    writeTrim = false;
+#endif
+}
+
+#ifdef SD_WRITE_RESERVE
+//Once the reserved clusters are used up, the next SD_WRITE_RESERVE bytes in one run
+void CardReader::writeReserve()
+{
+    if (file.fileSize() < writeReserveEnd)
+        return;
+    uint32_t cluster = 512UL << volume.clusterSizeShift();
+    uint32_t size = (SD_WRITE_RESERVE + cluster - 1) / cluster * cluster;
+    if (file.reserve(size))
+    {
+        writeReserveEnd = (file.fileSize() + cluster - 1) / cluster * cluster + size;
+        writeTrim = true;
+    }
+    else
+    {
+        writeReserveEnd = 0xFFFFFFFF; //no free run that long, write() adds a cluster at a time
+    }
+}
+#endif
+#endif
+
 void CardReader::checkautostart(bool force)
 {
     if (!force)
@@ -517,14 +793,37 @@ void CardReader::checkautostart(bool force)
 
 void CardReader::closefile()
 {
+#ifdef SD_WRITE_BUFFER
+    writeClose();
+#endif
     file.sync();
+#ifdef SD_LAYER_INDEX
+    layerIndexStop();
+    if (writing)
+        layerIndexForget(file.firstCluster());
+#endif
     file.close();
     saving = false;
+    writing = false;
     logging = false;
 }
 
-void CardReader::getfilename(const uint8_t nr)
+void CardReader::getfilename(const uint16_t nr)
 {
+#ifdef SD_DIR_INDEX_SIZE
+    if (!dirIndexValid)
+        getnrfilenames();
+    if (nr < dirIndexFiles)
+    {
+        //start at the indexed file at or before nr instead of the top of the directory
+        curDir = &workDir;
+        lsAction = LS_GetFilename;
+        nrFiles = nr & ((1 << dirIndexShift) - 1);
+        curDir->seekSet((uint32_t)dirIndex[nr >> dirIndexShift] << 5);
+        lsDive("", *curDir);
+        return;
+    }
+#endif
     curDir = &workDir;
     lsAction = LS_GetFilename;
     nrFiles = nr;
@@ -535,14 +834,115 @@ void CardReader::getfilename(const uint8_t nr)
 uint16_t CardReader::getnrfilenames()
 {
     curDir = &workDir;
+#ifdef SD_DIR_INDEX_SIZE
+    if (dirIndexValid)
+        return dirIndexFiles;
+    dirIndexShift = 0;
+#endif
     lsAction = LS_Count;
     nrFiles = 0;
     curDir->rewind();
     lsDive("", *curDir);
     //SERIAL_ECHOLN(nrFiles);
+#ifdef SD_DIR_INDEX_SIZE
+    dirIndexFiles = nrFiles;
+    dirIndexValid = true;
+#endif
     return nrFiles;
 }
 
+#ifdef SD_DIR_INDEX_SIZE
+void CardReader::dirIndexAdd(uint16_t entry)
+{
+    if (nrFiles & ((1 << dirIndexShift) - 1))
+        return;
+    uint16_t i = nrFiles >> dirIndexShift;
+    if (i == SD_DIR_INDEX_SIZE)
+    {
+        //full, keep every other one and index every second file from here on
+        for (i = 0; i < SD_DIR_INDEX_SIZE / 2; i++)
+            dirIndex[i] = dirIndex[2 * i];
+        dirIndexShift++;
+    }
+    dirIndex[i] = entry;
+}
+#endif
+
+#ifdef SD_SORT_NEWEST_FIRST
+//by last write time, the later entry of two written in the same two seconds
+static bool sortNewer(uint32_t s1, uint16_t e1, uint32_t s2, uint16_t e2)
+{
+    return s1 != s2 ? s1 > s2 : e1 > e2;
+}
+
+void CardReader::sortAdd(const dir_t &p, uint16_t entry)
+{
+    uint32_t stamp = (uint32_t)p.lastWriteDate << 16 | p.lastWriteTime;
+    if (sortBound && !sortNewer(sortLastStamp, sortLastEntry, stamp, entry))
+        return; //in an earlier window
+    uint8_t i = sortCount;
+    if (i == SD_SORT_WINDOW)
+    {
+        if (!sortNewer(stamp, entry, sortStamp[i - 1], sortIndex[i - 1]))
+            return;
+        i--; //the oldest one drops out
+    }
+    else
+        sortCount++;
+    while (i > 0 && sortNewer(stamp, entry, sortStamp[i - 1], sortIndex[i - 1]))
+    {
+        sortStamp[i] = sortStamp[i - 1];
+        sortIndex[i] = sortIndex[i - 1];
+        i--;
+    }
+    sortStamp[i] = stamp;
+    sortIndex[i] = entry;
+}
+
+//one pass over workDir keeping the SD_SORT_WINDOW newest files, next for those after the current window
+void CardReader::sortScan(bool next)
+{
+    uint32_t stamps[SD_SORT_WINDOW];
+    sortBound = next;
+    if (next)
+    {
+        sortStart += sortCount;
+        sortLastEntry = sortIndex[sortCount - 1];
+    }
+    else
+        sortStart = 0;
+    sortCount = 0;
+    sortStamp = stamps;
+    curDir = &workDir;
+    lsAction = LS_Sort;
+    curDir->rewind();
+    lsDive("", *curDir);
+    if (sortCount)
+        sortLastStamp = stamps[sortCount - 1];
+    sortStamp = 0;
+    sortValid = true;
+}
+
+void CardReader::getfilename_sorted(const uint16_t nr)
+{
+    if (!sortValid || nr < sortStart)
+        sortScan(false);
+    while (nr >= sortStart + sortCount && sortCount == SD_SORT_WINDOW)
+        sortScan(true);
+    if (nr >= sortStart + sortCount)
+    {
+        filename[0] = longFilename[0] = 0;
+        filenameIsDir = false;
+        return;
+    }
+    curDir = &workDir;
+    lsAction = LS_GetFilename;
+    nrFiles = 0;
+    curDir->seekSet((uint32_t)sortIndex[nr - sortStart] << 5);
+    lsDive("", *curDir);
+}
+#endif
+
 void CardReader::chdir(const char *relpath)
 {
     SdFile newfile;
@@ -566,6 +966,9 @@ void CardReader::chdir(const char *relpath)
             workDirParents[0] = *parent;
         }
         workDir = newfile;
+#ifdef SD_DIR_INDEX_SIZE
+        dirIndexClear();
+#endif
     }
     //SERIAL_ECHOLN(relpath);
 }
@@ -579,13 +982,520 @@ void CardReader::updir()
         int d;
         for (int d = 0; d < workDirDepth; d++)
             workDirParents[d] = workDirParents[d + 1];
+#ifdef SD_DIR_INDEX_SIZE
+        dirIndexClear();
+#endif
+    }
+}
+
+#ifdef SD_LAYER_INDEX
+static void layerIndexName(char *name, uint32_t cluster)
+{
+    sprintf_P(name, PSTR("Z%07lX.LYR"), (unsigned long)cluster);
+}
+
+//Value after the first c of a G-code line, the comment not counted
+static bool layerWord(const char *s, char c, float &v)
+{
+    for (; *s && *s != ';'; s++)
+    {
+        if (*s == c)
+        {
+            v = parse_float(s + 1);
+            return true;
+        }
     }
+    return false;
 }
 
+//Take the index of the print file just opened if it is still good for it, else start scanning it
+void CardReader::layerIndexOpen()
+{
+    dir_t d;
+    layer_head_t h;
+    char name[13];
+    layerIndexStop();
+    if (!filesize || !file.dirEntry(&d))
+        return;
+    layerIndexName(name, file.firstCluster());
+    if (openRootFile(layerFile, name, O_READ) && layerFile.read(&h, sizeof(h)) == sizeof(h) && !memcmp(h.magic, LAYER_MAGIC, 4) &&
+        h.done && h.size == filesize && h.date == d.lastWriteDate && h.time == d.lastWriteTime)
+    {
+        layerCount = h.count;
+#ifdef SD_FILE_META
+        meta = h.meta;
+#endif
+        layerState = LAYER_DONE;
+        return;
+    }
+    layerFile.close();
+
+    //the head is written once the scan is done, until then the file is no index
+    memset(&h, 0, sizeof(h));
+    layerIn = file;
+    uint32_t start = 0;
+#ifdef SD_FILE_META
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        meta.boxMin[i] = 9999.0;
+        meta.boxMax[i] = -9999.0;
+    }
+    metaX = metaY = metaSeconds = 0.0;
+    metaF = 1200.0;
+    metaTool = 0;
+    if (filesize > META_TAIL)
+        start = filesize - META_TAIL; //totals some slicers only write after the last layer, read before the scan gets there
+#endif
+    if (!layerIn.seekSet(start) || !openRootFile(layerFile, name, O_CREAT | O_TRUNC | O_RDWR) ||
+        layerFile.write(&h, sizeof(h)) != sizeof(h))
+    {
+        layerIndexStop();
+        return;
+    }
+    layerCount = 0;
+    layerMidLine = start != 0; //the tail starts somewhere in a line
+    layerRelXYZ = layerRelE = false;
+    layerZ = layerE = layerTop = 0.0;
+    layerCandPos = 0xFFFFFFFF;
+    layerState = start ? LAYER_TAIL : LAYER_SCAN;
+}
+
+void CardReader::layerIndexDone()
+{
+    dir_t d;
+    layer_head_t h;
+    if (!file.dirEntry(&d))
+    {
+        layerIndexStop();
+        return;
+    }
+#ifdef SD_FILE_META
+    if (!(meta.fromSlicer & META_TIME))
+        meta.seconds = metaSeconds;
+    if (!(meta.fromSlicer & META_LAYERS))
+        meta.layers = layerCount;
+    if (meta.boxMin[2] > meta.boxMax[2]) //nothing extruded
+    {
+        memset(meta.boxMin, 0, sizeof(meta.boxMin));
+        memset(meta.boxMax, 0, sizeof(meta.boxMax));
+    }
+    h.meta = meta;
+#endif
+    memcpy(h.magic, LAYER_MAGIC, 4);
+    h.size = filesize;
+    h.date = d.lastWriteDate;
+    h.time = d.lastWriteTime;
+    h.count = layerCount;
+    h.done = 1;
+    h.pad = 0;
+    if (!layerFile.seekSet(0) || layerFile.write(&h, sizeof(h)) != sizeof(h) || !layerFile.sync())
+    {
+        layerIndexStop();
+        return;
+    }
+    layerIn.close();
+    layerState = LAYER_DONE;
+}
+
+void CardReader::layerIndexStop()
+{
+    layerIn.close();
+    layerFile.close();
+    layerState = LAYER_NONE;
+#ifdef SD_FILE_META
+    memset(&meta, 0, sizeof(meta));
+#endif
+}
+
+//A file was written or removed: an index left for the file starting at cluster is no good any more
+void CardReader::layerIndexForget(uint32_t cluster)
+{
+    char name[13];
+    if (!cluster)
+        return;
+    layerIndexName(name, cluster);
+    if (SdFile::remove(&root, name))
+    {
+#ifdef SD_DIR_INDEX_SIZE
+        dirIndexClear();
+#endif
+    }
+}
+
+//Index files of files deleted elsewhere: the cluster they are named after is free now
+void CardReader::layerIndexTidy()
+{
+    dir_t d;
+    char name[13];
+    root.rewind();
+    while (root.readDir(&d, NULL) > 0)
+    {
+        if (d.name[0] != 'Z' || d.name[8] != 'L' || d.name[9] != 'Y' || d.name[10] != 'R')
+            continue;
+        uint32_t cluster = 0;
+        uint8_t i;
+        for (i = 1; i < 8; i++)
+        {
+            char c = d.name[i];
+            if (c >= '0' && c <= '9')
+                cluster = (cluster << 4) | (c - '0');
+            else if (c >= 'A' && c <= 'F')
+                cluster = (cluster << 4) | (c - 'A' + 10);
+            else
+                break;
+        }
+        uint32_t next;
+        if (i < 8 || (cluster >= 2 && cluster < volume.clusterCount() + 2 && (!volume.dbgFat(cluster, &next) || next != 0)))
+            continue;
+        uint32_t pos = root.curPosition(); //remove() searches root from the top
+        layerIndexName(name, cluster);
+        SdFile::remove(&root, name);
+        root.seekSet(pos);
+    }
+}
+
+//Called from manage_inactivity() while the card is not feeding a print: read the tail or scan on for 2 ms
+void CardReader::layerIndexStep()
+{
+    if ((layerState != LAYER_TAIL && layerState != LAYER_SCAN) || saving || !cardOK)
+        return;
+    char line[MAX_CMD_SIZE];
+    unsigned long t = millis();
+    do
+    {
+        uint32_t pos = layerIn.curPosition();
+        int16_t n = layerIn.readLine(line, sizeof(line) - 1);
+        if (n <= 0)
+        {
+            if (n < 0)
+                layerIndexStop();
+            else if (layerState == LAYER_SCAN)
+                layerIndexDone();
+            else if (!layerIn.seekSet(0)) //tail read, scan from the top
+                layerIndexStop();
+            else
+            {
+                layerMidLine = false;
+                layerState = LAYER_SCAN;
+                continue;
+            }
+            return;
+        }
+        line[n] = 0;
+#ifdef SD_FILE_META
+        if (layerState == LAYER_TAIL)
+        {
+            if (!layerMidLine && line[0] == ';')
+                metaComment(line + 1);
+        }
+        else
+#endif
+        if (!layerMidLine)
+            layerLine(line, pos);
+        layerMidLine = line[n - 1] != '\n' && line[n - 1] != '\r';
+    } while ((layerState == LAYER_TAIL || layerState == LAYER_SCAN) && millis() - t < 2);
+}
+
+//Follow Z and E through the line at pos. A rise above the last layer starts a new one at that line,
+//once something is extruded at the new height, so z hops over travel moves are no layers.
+void CardReader::layerLine(const char *s, uint32_t pos)
+{
+    float v;
+    while (*s == ' ' || *s == '\t')
+        s++;
+#ifdef SD_FILE_META
+    if (*s == ';')
+    {
+        metaComment(s + 1);
+        return;
+    }
+    if (*s == 'T')
+    {
+        metaTool = parse_long(s + 1) & 1;
+        return;
+    }
+#endif
+    if (*s == 'M')
+    {
+        int code = parse_long(s + 1);
+        if (code == 82 || code == 83)
+            layerRelE = code == 83;
+        return;
+    }
+    if (*s != 'G')
+        return;
+    int code = parse_long(s + 1);
+    if (code == 0 || code == 1)
+    {
+        float z = layerZ;
+        float e = layerE;
+        if (layerWord(s, 'Z', v))
+            z = layerRelXYZ ? z + v : v;
+        if (layerWord(s, 'E', v))
+            e = (layerRelXYZ || layerRelE) ? e + v : v;
+#ifdef SD_FILE_META
+        metaMove(s, z, e);
+#endif
+        if (z != layerZ)
+        {
+            layerCandPos = z >= layerTop + LAYER_MIN_STEP ? pos : 0xFFFFFFFF;
+            layerCandE = layerE;
+            layerZ = z;
+        }
+        if (e > layerE && layerCandPos != 0xFFFFFFFF)
+        {
+            layer_t l = {layerZ, layerCandPos, layerCandE};
+            if (layerFile.write(&l, sizeof(l)) != sizeof(l))
+            {
+                layerIndexStop();
+                return;
+            }
+            layerCount++;
+            layerTop = layerZ;
+            layerCandPos = 0xFFFFFFFF;
+        }
+        layerE = e;
+    }
+    else if (code == 28)
+    {
+        if ((!layerWord(s, 'X', v) && !layerWord(s, 'Y', v)) || layerWord(s, 'Z', v))
+        {
+            layerZ = 0.0;
+            layerCandPos = 0xFFFFFFFF;
+        }
+#ifdef SD_FILE_META
+        bool all = !layerWord(s, 'X', v) && !layerWord(s, 'Y', v) && !layerWord(s, 'Z', v);
+        if (all || layerWord(s, 'X', v))
+            metaX = 0.0;
+        if (all || layerWord(s, 'Y', v))
+            metaY = 0.0;
+#endif
+    }
+    else if (code == 90 || code == 91)
+    {
+        layerRelXYZ = code == 91;
+    }
+    else if (code == 92)
+    {
+        if (layerWord(s, 'Z', v))
+            layerZ = v;
+        if (layerWord(s, 'E', v))
+            layerE = v;
+    }
+}
+
+#ifdef SD_FILE_META
+//Rest of s after key, NULL if s does not start with it
+static const char *metaKey(const char *s, const char *key)
+{
+    uint8_t n = strlen_P(key);
+    return strncmp_P(s, key, n) ? NULL : s + n;
+}
+
+//"1d 2h 3m 4s", "1 hours 2 minutes" or plain seconds
+static uint32_t metaDuration(const char *p)
+{
+    uint32_t t = 0;
+    const char *end;
+    for (;;)
+    {
+        long v = parse_long(p, &end);
+        if (end == p)
+            return t;
+        for (p = end; *p == ' '; p++)
+            ;
+        if (*p == 'd')
+            v *= 86400L;
+        else if (*p == 'h')
+            v *= 3600L;
+        else if (*p == 'm')
+            v *= 60L;
+        t += v;
+        while (*p && *p != ' ' && (*p < '0' || *p > '9'))
+            p++;
+        while (*p == ' ')
+            p++;
+    }
+}
+
+//Comma separated lengths, one per extruder, times scale for mm
+static void metaFilament(const char *p, float scale, float *f)
+{
+    const char *end;
+    f[0] = f[1] = 0.0;
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        f[i] = parse_float(p, &end) * scale;
+        for (p = end; *p == ' ' || *p == 'm'; p++)
+            ;
+        if (*p++ != ',')
+            return;
+    }
+}
+
+//Comments with the slicer's own figures: Cura's head, PrusaSlicer's and Simplify3D's tail
+void CardReader::metaComment(const char *s)
+{
+    const char *p;
+    while (*s == ' ')
+        s++;
+    if ((p = metaKey(s, PSTR("TIME:"))) != NULL)
+    {
+        meta.seconds = parse_long(p);
+        meta.fromSlicer |= META_TIME;
+    }
+    else if ((p = metaKey(s, PSTR("estimated printing time (normal mode) = "))) != NULL ||
+             (p = metaKey(s, PSTR("Build time: "))) != NULL)
+    {
+        meta.seconds = metaDuration(p);
+        meta.fromSlicer |= META_TIME;
+    }
+    else if ((p = metaKey(s, PSTR("Filament used: "))) != NULL)
+    {
+        metaFilament(p, 1000.0, meta.filament);
+        meta.fromSlicer |= META_FILAMENT;
+    }
+    else if ((p = metaKey(s, PSTR("filament used [mm] = "))) != NULL ||
+             (p = metaKey(s, PSTR("Filament length: "))) != NULL)
+    {
+        metaFilament(p, 1.0, meta.filament);
+        meta.fromSlicer |= META_FILAMENT;
+    }
+    else if ((p = metaKey(s, PSTR("LAYER_COUNT:"))) != NULL)
+    {
+        meta.layers = parse_long(p);
+        meta.fromSlicer |= META_LAYERS;
+    }
+    else if (s[0] == 'M' && ((s[1] == 'I' && s[2] == 'N') || (s[1] == 'A' && s[2] == 'X')) &&
+             s[3] >= 'X' && s[3] <= 'Z' && s[4] == ':')
+    {
+        (s[1] == 'I' ? meta.boxMin : meta.boxMax)[s[3] - 'X'] = parse_float(s + 5);
+        meta.fromSlicer |= META_BOX;
+    }
+}
+
+//Time, filament and extruded size of a G0/G1 from layerZ, layerE to z, e.
+//The time leaves out acceleration, so it comes out short on prints of small moves.
+void CardReader::metaMove(const char *s, float z, float e)
+{
+    float v;
+    float x = metaX;
+    float y = metaY;
+    if (layerWord(s, 'X', v))
+        x = layerRelXYZ ? x + v : v;
+    if (layerWord(s, 'Y', v))
+        y = layerRelXYZ ? y + v : v;
+    if (layerWord(s, 'F', v) && v > 0.0)
+        metaF = v;
+    float dx = x - metaX, dy = y - metaY, dz = z - layerZ, de = e - layerE;
+    float d = sqrt(dx * dx + dy * dy + dz * dz);
+    if (d == 0.0)
+        d = fabs(de);
+    metaSeconds += d * 60.0 / metaF;
+    if (!(meta.fromSlicer & META_FILAMENT))
+        meta.filament[metaTool] += de;
+    if (de > 0.0 && d > 0.0 && !(meta.fromSlicer & META_BOX))
+    {
+        float to[3] = {x, y, z};
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            if (to[i] < meta.boxMin[i])
+                meta.boxMin[i] = to[i];
+            if (to[i] > meta.boxMax[i])
+                meta.boxMax[i] = to[i];
+        }
+    }
+    metaX = x;
+    metaY = y;
+}
+
+void CardReader::printMeta()
+{
+    SERIAL_ECHO_START;
+    if (!isFileOpen() || layerState == LAYER_NONE)
+    {
+        SERIAL_ECHOLNPGM("No file info");
+        return;
+    }
+    SERIAL_ECHOPGM("File time:");
+    SERIAL_ECHO(meta.seconds);
+    SERIAL_ECHOPGM("s filament:");
+    SERIAL_ECHO(meta.filament[0]);
+    SERIAL_ECHOPGM(",");
+    SERIAL_ECHO(meta.filament[1]);
+    SERIAL_ECHOPGM("mm layers:");
+    SERIAL_ECHO(meta.layers);
+    for (uint8_t i = 0; i < 3 && meta.boxMin[2] <= meta.boxMax[2]; i++)
+    {
+        SERIAL_ECHO(' ');
+        SERIAL_ECHO((char)('X' + i));
+        SERIAL_ECHO(meta.boxMin[i]);
+        SERIAL_ECHO('-');
+        SERIAL_ECHO(meta.boxMax[i]);
+    }
+    SERIAL_ECHOPGM(" from slicer:");
+    SERIAL_ECHO((int)meta.fromSlicer);
+    if (layerState == LAYER_TAIL || layerState == LAYER_SCAN)
+        SERIAL_ECHOPGM(" scanning");
+    SERIAL_ECHOLN("");
+}
+#endif
+
+bool CardReader::layerRead(uint16_t i, layer_t &l)
+{
+    return layerFile.seekSet(sizeof(layer_head_t) + (uint32_t)i * sizeof(layer_t)) && layerFile.read(&l, sizeof(l)) == sizeof(l);
+}
+
+//Layers started at or before pos
+uint16_t CardReader::layerAt(uint32_t pos)
+{
+    layer_t l;
+    uint16_t lo = 0, hi = layerCount;
+    while (lo < hi)
+    {
+        uint16_t mid = (lo + hi) / 2;
+        if (!layerRead(mid, l))
+            return 0;
+        if (l.pos <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool CardReader::layerSeek(float z)
+{
+    layer_t l;
+    if (layerState != LAYER_DONE)
+        return false;
+    uint16_t lo = 0, hi = layerCount;
+    while (lo < hi)
+    {
+        uint16_t mid = (lo + hi) / 2;
+        if (!layerRead(mid, l))
+            return false;
+        if (l.z < z - 0.005)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == layerCount || !layerRead(lo, l))
+        return false;
+    layerJumpZ = l.z;
+    layerJumpE = l.e;
+    setIndex(l.pos);
+    return true;
+}
+#endif
+
 void CardReader::printingHasFinished()
 {
     st_synchronize();
     quickStop();
+#ifdef SD_LAYER_INDEX
+    layerIndexStop();
+#endif
     file.close();
     sdprinting = 0;
     finishAndDisableSteppers(true); //By Zyf
@@ -10,8 +10,51 @@ enum LsAction
 {
 	LS_SerialPrint,
 	LS_Count,
-	LS_GetFilename
+	LS_GetFilename,
+	LS_Sort
 };
+
+#if defined(SD_SORT_NEWEST_FIRST) && !defined(SD_DIR_INDEX_SIZE)
+#error SD_SORT_NEWEST_FIRST needs SD_DIR_INDEX_SIZE
+#endif
+#if defined(SD_LAYER_INDEX) && !defined(PRINT_FROM_Z_HEIGHT)
+#error SD_LAYER_INDEX needs PRINT_FROM_Z_HEIGHT
+#endif
+#if defined(SD_FILE_META) && !defined(SD_LAYER_INDEX)
+#error SD_FILE_META needs SD_LAYER_INDEX
+#endif
+#if defined(SD_WRITE_RESERVE) && !defined(SD_WRITE_BUFFER)
+#error SD_WRITE_RESERVE needs SD_WRITE_BUFFER
+#endif
+#if defined(SD_WRITE_BUFFER) && !defined(SD_WRITE_SYNC_MS)
+#define SD_WRITE_SYNC_MS 5000
+#endif
+
+#ifdef SD_LAYER_INDEX
+//A layer of the print file in its index file: the line that moves up to z, and E before that line
+struct layer_t
+{
+	float z;
+	uint32_t pos;
+	float e;
+};
+#endif
+#ifdef SD_FILE_META
+#define META_TIME 1     // fields of file_meta_t the slicer put in comments, the others are worked out by the scan
+#define META_FILAMENT 2
+#define META_LAYERS 4
+#define META_BOX 8
+//What a print file will take, kept with its layer index
+struct file_meta_t
+{
+	uint32_t seconds;   // print time, 0 while unknown
+	float filament[2];  // mm of filament per extruder
+	uint16_t layers;
+	uint8_t fromSlicer; // META_ bits
+	float boxMin[3];    // extruded XYZ range
+	float boxMax[3];
+};
+#endif
 class CardReader
 {
 public:
@@ -19,22 +62,42 @@ public:
 
 	void initsd();
 	void write_command(char *buf);
+	bool write_block(const uint8_t *buf, uint16_t len); //raw bytes to the file opened for writing
+#ifdef SD_WRITE_BUFFER
+	void writeSyncStep(); //sync the file being written once SD_WRITE_SYNC_MS have passed
+#endif
 	//files auto[0-9].g on the sd card are performed in a row
 	//this is to delay autostart and hence the initialisaiton of the sd card to some seconds after the normal init, so the device is available quick after a reset
 
 	void checkautostart(bool x);
 	void openFile(char *lngName, char *name, bool read, uint32_t startPos = 0); //By zyf
 	void openLogFile(char *name);
+	bool openRootFile(SdFile &f, const char *name, uint8_t oflag); //second file in root, print file stays open
 	void removeFile(char *name);
 	void closefile();
 	void release();
 	void startFileprint();
 	void pauseSDPrint();
 	void getStatus();
+	void readSpeed(uint16_t blocks);
 	void printingHasFinished();
 
-	void getfilename(const uint8_t nr);
+	void getfilename(const uint16_t nr);
 	uint16_t getnrfilenames();
+#ifdef SD_SORT_NEWEST_FIRST
+	void getfilename_sorted(const uint16_t nr); //nr-th newest, same files as getfilename()
+#endif
+
+#ifdef SD_LAYER_INDEX
+	void layerIndexStep();   //index a little more of the print file, while the card is not busy printing
+	bool layerSeek(float z); //move the print file to its first layer at or above z, false if not indexed
+	float layerJumpZ;        //Z and E at the line layerSeek() moved to
+	float layerJumpE;
+#endif
+#ifdef SD_FILE_META
+	file_meta_t meta; //of the print file, only complete once its layers are indexed
+	void printMeta();
+#endif
 
 	void ls();
 	void chdir(const char *relpath);
@@ -48,6 +111,14 @@ public:
 		sdpos = file.curPosition();
 		return (int16_t)file.read();
 	};
+	//Next line with its '\n' or '\r', at most len bytes, 0 at the end of the file.
+	//sdpos is left on the last byte read, as get() would.
+	FORCE_INLINE int16_t getLine(char *buf, uint16_t len)
+	{
+		int16_t n = file.readLine(buf, len);
+		sdpos = file.curPosition() - (n > 0);
+		return n;
+	};
 	FORCE_INLINE void setIndex(long index)
 	{
 		sdpos = index;
@@ -87,6 +158,7 @@ public:
 public:
 	bool heating;
 	bool saving;
+	bool writing; //a file is open for writing, by M28/M928 or an M1100 upload
 	bool logging;
 	int sdprinting;
 	bool cardOK;
@@ -111,6 +183,82 @@ private:
 	int16_t nrFiles;   //counter for the files in the current directory and recycled as position counter for getting the nrFiles'th name in the directory.
 	char *diveDirName;
 	void lsDive(const char *prepend, SdFile parent);
+#ifdef SD_DIR_INDEX_SIZE
+	//directory entry of every (1 << dirIndexShift)th listed file of workDir, built by getnrfilenames()
+	uint16_t dirIndex[SD_DIR_INDEX_SIZE];
+	uint16_t dirIndexFiles;
+	uint8_t dirIndexShift;
+	bool dirIndexValid;
+	void dirIndexAdd(uint16_t entry);
+#ifdef SD_SORT_NEWEST_FIRST
+	FORCE_INLINE void dirIndexClear() { dirIndexValid = sortValid = false; }
+#else
+	FORCE_INLINE void dirIndexClear() { dirIndexValid = false; }
+#endif
+#endif
+#ifdef SD_SORT_NEWEST_FIRST
+	//directory entries of the newest first files sortStart to sortStart + sortCount - 1 of workDir
+	uint16_t sortIndex[SD_SORT_WINDOW];
+	uint16_t sortStart;
+	uint8_t sortCount;
+	bool sortValid;
+	bool sortBound;         //the window after the one ending at sortLastStamp/sortLastEntry
+	uint32_t sortLastStamp;
+	uint16_t sortLastEntry;
+	uint32_t *sortStamp;    //write times of sortIndex while sortScan() runs
+	void sortScan(bool next);
+	void sortAdd(const dir_t &p, uint16_t entry);
+#endif
+#ifdef SD_LAYER_INDEX
+	//layers of the print file, kept in a root file named after its first cluster and built once
+	SdFile layerIn;         //the print file, scanned on by layerIndexStep()
+	SdFile layerFile;
+	uint8_t layerState;
+	uint16_t layerCount;
+	bool layerMidLine;      //the last chunk read did not end its line, or the tail read starts in one
+	bool layerRelXYZ;
+	bool layerRelE;
+	float layerZ;           //where the lines scanned so far have moved to
+	float layerE;
+	float layerTop;         //Z of the last layer
+	uint32_t layerCandPos;  //line that moved up to layerZ, a layer once something is extruded there
+	float layerCandE;
+	void layerIndexOpen();
+	void layerIndexDone();
+	void layerIndexStop();
+	void layerIndexForget(uint32_t cluster);
+	void layerIndexTidy();
+	void layerLine(const char *s, uint32_t pos);
+	bool layerRead(uint16_t i, layer_t &l);
+	uint16_t layerAt(uint32_t pos);
+#endif
+#ifdef SD_WRITE_BUFFER
+	//lines for the file being written, gathered into its current block
+	uint8_t *writeBuf;
+	uint16_t writeLen;         //bytes of the block in writeBuf
+	uint16_t writeDone;        //of those, already written to file
+	unsigned long writeSyncMs;
+#ifndef SD_READ_AHEAD
+	uint8_t writeBlock[512];
+#endif
+#ifdef SD_WRITE_RESERVE
+	uint32_t writeReserveEnd;  //file size at which its reserved clusters run out
+	bool writeTrim;            //clusters are reserved past the end of file
+	void writeReserve();
+#endif
+	void writeOpen();
+	bool writeFlush();
+	void writeClose();
+#endif
+#ifdef SD_FILE_META
+	float metaX;            //scan position and feed rate for the worked out time
+	float metaY;
+	float metaF;
+	float metaSeconds;
+	uint8_t metaTool;
+	void metaComment(const char *s);
+	void metaMove(const char *s, float z, float e);
+#endif
 };
 extern CardReader card;
 #define IS_SD_PRINTING (card.sdprinting == 1)
@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <avr/pgmspace.h>
+#include "parse_number.h"
+
+static const float pow10_P[10] PROGMEM = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+float parse_float(const char *p, const char **end)
+{
+    const char *start = p;
+    bool digits = false;
+    while (*p == ' ')
+        p++;
+    bool neg = (*p == '-');
+    if (*p == '-' || *p == '+')
+        p++;
+
+    uint32_t m = 0;   // digits as an integer
+    int16_t exp10 = 0; // decimal places in m, negative when integer digits were dropped
+    bool frac = false;
+    for (;; p++)
+    {
+        char c = *p;
+        if (c >= '0' && c <= '9')
+        {
+            digits = true;
+            if (m < 100000000UL) // 9 significant digits is more than a float holds
+            {
+                m = m * 10 + (c - '0');
+                if (frac)
+                    exp10++;
+            }
+            else if (!frac)
+                exp10--;
+        }
+        else if (c == '.' && !frac)
+            frac = true;
+        else
+            break;
+    }
+    if (end)
+        *end = digits ? p : start;
+
+    float f = m;
+    while (exp10 > 0)
+    {
+        uint8_t n = exp10 > 9 ? 9 : exp10;
+        f /= pgm_read_float(&pow10_P[n]);
+        exp10 -= n;
+    }
+    while (exp10 < 0)
+    {
+        uint8_t n = -exp10 > 9 ? 9 : -exp10;
+        f *= pgm_read_float(&pow10_P[n]);
+        exp10 += n;
+    }
+    return neg ? -f : f;
+}
+
+long parse_long(const char *p, const char **end)
+{
+    const char *start = p;
+    while (*p == ' ')
+        p++;
+    bool neg = (*p == '-');
+    if (*p == '-' || *p == '+')
+        p++;
+    const char *first = p;
+    unsigned long n = 0;
+    while (*p >= '0' && *p <= '9')
+        n = n * 10 + (*p++ - '0');
+    if (end)
+        *end = p > first ? p : start;
+    return neg ? -(long)n : (long)n;
+}
@@ -0,0 +1,10 @@
+#ifndef PARSE_NUMBER_H
+#define PARSE_NUMBER_H
+
+//Number parsers for G-code, much cheaper than avr-libc strtod/strtol.
+//They take what hosts and slicers send: [spaces][+|-]digits[.digits], no exponent, no hex.
+//end, when given, is set past the number like strtod/strtol do, to p when there was none.
+float parse_float(const char *p, const char **end = 0);
+long parse_long(const char *p, const char **end = 0);
+
+#endif
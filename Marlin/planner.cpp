@@ -670,6 +670,16 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   //Searching the height point by "dichotomy" -- by zyf
   if (!PrintFromZHeightFound && card.sdprinting == 1)
   {
+#ifdef SD_LAYER_INDEX
+    //with the file indexed the first move jumps to the layer, the rest of its command is dropped
+    if (bLayerJump)
+      return;
+    if (lPrintZEnd == 0 && card.layerSeek(print_from_z_target))
+    {
+      layer_jump_skip_queued();
+      return;
+    }
+#endif
     if ((z != print_from_z_target && lPrintZEnd - lPrintZStart > 1024) || lPrintZEnd == 0)
     {
       bool bSetIndex = true;
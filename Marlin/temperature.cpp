@@ -31,6 +31,9 @@
 
 #include "Marlin.h"
 #include "temperature.h"
+#ifdef TEMP_TELEMETRY
+#include "cardreader.h"
+#endif
 
 //===========================================================================
 //=============================public variables============================
@@ -64,6 +67,15 @@ float bedKd = (DEFAULT_bedKd / PID_dT);
 unsigned char fanSpeedSoftPwm;
 #endif
 
+#ifdef THERMAL_MODEL_PROTECTION
+// index EXTRUDERS is the bed
+float tm_gain[EXTRUDERS + 1] = {0}; // degC above ambient per soft_pwm step, 0 = no model
+float tm_tau[EXTRUDERS + 1] = {0};  // time constant in seconds
+int tm_tolerance = THERMAL_MODEL_TOLERANCE;
+int tm_count = THERMAL_MODEL_COUNT;
+bool tm_enabled = true;
+#endif
+
 //===========================================================================
 //=============================private variables============================
 //===========================================================================
@@ -164,6 +176,40 @@ unsigned long watchmillis_fall[EXTRUDERS] = ARRAY_BY_EXTRUDERS(0, 0, 0);
 #define SOFT_PWM_SCALE 0
 #endif
 
+#ifdef THERMAL_MODEL_PROTECTION
+static float tm_predicted[EXTRUDERS + 1];
+static unsigned char tm_err_count[EXTRUDERS + 1];
+static bool tm_running[EXTRUDERS + 1];
+#endif
+
+#ifdef TEMP_ADC_FREE_RUNNING
+#if TEMP_ADC_MEDIAN < 1 || TEMP_ADC_MEDIAN > 5
+#error "TEMP_ADC_MEDIAN must be between 1 and 5"
+#endif
+#if TEMP_ADC_OVERSAMPLE < 4 || TEMP_ADC_OVERSAMPLE > 64
+#error "TEMP_ADC_OVERSAMPLE must be between 4 and 64"
+#endif
+
+// Same channel order as the timer state machine
+#define ADC_CHANNELS 4
+// 13 ADC clocks at F_CPU/128, 104 us at 16 MHz. A round over all channels must be done
+// within the 128 ms between two readings, or PID_dT would no longer hold.
+#define ADC_CONVERSION_US (13L * 128 * 1000000L / F_CPU)
+#if (TEMP_ADC_OVERSAMPLE * TEMP_ADC_MEDIAN * ADC_CHANNELS * ADC_CONVERSION_US) >= 128000L
+#error "TEMP_ADC_OVERSAMPLE * TEMP_ADC_MEDIAN too big, a round would not finish within PID_dT"
+#endif
+static const signed char adc_channel_pin[ADC_CHANNELS] = {TEMP_0_PIN, TEMP_BED_PIN, TEMP_1_PIN, TEMP_2_PIN};
+static unsigned int adc_sum[ADC_CHANNELS];
+static unsigned int adc_median_buf[TEMP_ADC_MEDIAN];
+static unsigned char adc_channel = 0;
+static unsigned char adc_sample_count = 0;
+static unsigned char adc_median_count = 0;
+static volatile bool adc_round_done = true;
+
+// Scale a sum of TEMP_ADC_OVERSAMPLE samples to what the thermistor tables expect
+#define ADC_SCALE(s) (int)((unsigned long)(s) * OVERSAMPLENR / TEMP_ADC_OVERSAMPLE)
+#endif //TEMP_ADC_FREE_RUNNING
+
 //===========================================================================
 //=============================   functions      ============================
 //===========================================================================
@@ -185,6 +231,12 @@ void PID_autotune(float temp, int extruder, int ncycles)
   float Kp, Ki, Kd;
   float max = 0, min = 10000;
 
+#ifdef THERMAL_MODEL_PROTECTION
+  // first heat up, timed between 1/3 and 2/3 of the way to temp
+  float tm_start = -1, tm_low = 0, tm_slope = 0, tm_mid = 0;
+  unsigned long tm_low_ms = 0;
+#endif
+
   if ((extruder > EXTRUDERS)
 #if (TEMP_BED_PIN <= -1)
       || (extruder < 0)
@@ -221,6 +273,25 @@ void PID_autotune(float temp, int extruder, int ncycles)
 
       max = max(max, input);
       min = min(min, input);
+#ifdef THERMAL_MODEL_PROTECTION
+      if (cycles == 0 && heating == true && tm_slope == 0)
+      {
+        if (tm_start < 0)
+        {
+          tm_start = input;
+        }
+        else if (tm_low_ms == 0 && input > tm_start + (temp - tm_start) / 3.0)
+        {
+          tm_low = input;
+          tm_low_ms = millis();
+        }
+        else if (tm_low_ms != 0 && input > tm_start + (temp - tm_start) * 2.0 / 3.0 && millis() > tm_low_ms)
+        {
+          tm_slope = (input - tm_low) * 1000.0 / (millis() - tm_low_ms);
+          tm_mid = (input + tm_low) / 2.0;
+        }
+      }
+#endif
       if (heating == true && input > temp)
       {
         if (millis() - t2 > 5000)
@@ -336,6 +407,27 @@ void PID_autotune(float temp, int extruder, int ncycles)
     }
     if (cycles > ncycles)
     {
+#ifdef THERMAL_MODEL_PROTECTION
+      // Average soft_pwm holding temp is bias/2, the first heat up ran at full power
+      if (bias > 0 && tm_slope > 0)
+      {
+        int h = (extruder < 0) ? EXTRUDERS : extruder;
+        float gain = (temp - THERMAL_MODEL_AMBIENT) / (bias / 2.0);
+        float pwm0 = (extruder < 0 ? (MAX_BED_POWER) : (PID_MAX)) / 2;
+        float tau = (THERMAL_MODEL_AMBIENT + gain * pwm0 - tm_mid) / tm_slope;
+        if (gain > 0 && tau > 0)
+        {
+          tm_gain[h] = gain;
+          tm_tau[h] = tau;
+          tm_running[h] = false;
+          SERIAL_PROTOCOLPGM(" Thermal model G: ");
+          SERIAL_PROTOCOL(gain);
+          SERIAL_PROTOCOLPGM(" C: ");
+          SERIAL_PROTOCOLLN(tau);
+          SERIAL_PROTOCOLLNPGM(" Applied, M500 to save it");
+        }
+      }
+#endif
       SERIAL_PROTOCOLLNPGM("PID Autotune finished! Put the Kp, Ki and Kd constants into Configuration.h");
       return;
     }
@@ -434,6 +526,233 @@ void checkExtruderAutoFans()
 
 #endif // any extruder auto fan pins set
 
+#ifdef THERMAL_MODEL_PROTECTION
+// T' = (ambient + gain * pwm - T) / tau, stepped once per reading with the pwm of the last period.
+// The prediction follows the reading slowly, so fans and filament flow stay within tolerance
+// while a sensor or heater that stops following the model does not.
+// Returns 0 if ok, 3 if hotter than the model (runaway), 4 if colder (heater or thermistor lost).
+static int thermal_model_check(uint8_t h, float temp, unsigned char pwm)
+{
+  if (!tm_enabled || tm_gain[h] <= 0 || tm_tau[h] <= 0 || !tm_running[h])
+  {
+    tm_predicted[h] = temp;
+    tm_err_count[h] = 0;
+    tm_running[h] = tm_enabled && tm_gain[h] > 0 && tm_tau[h] > 0;
+    return 0;
+  }
+
+  float predicted = tm_predicted[h];
+  predicted += (PID_dT / tm_tau[h]) * (THERMAL_MODEL_AMBIENT + tm_gain[h] * pwm - predicted);
+  float residual = temp - predicted;
+  tm_predicted[h] = predicted + residual * THERMAL_MODEL_TRACKING;
+
+  if (fabs(residual) < tm_tolerance)
+  {
+    tm_err_count[h] = 0;
+    return 0;
+  }
+  if (++tm_err_count[h] < tm_count)
+    return 0;
+
+  tm_running[h] = false;
+  SERIAL_ERROR_START;
+  SERIAL_ERRORPGM("Thermal model: ");
+  SERIAL_ERROR((int)h);
+  SERIAL_ERRORPGM(" off by ");
+  SERIAL_ERRORLN(residual);
+  return (residual > 0) ? 3 : 4;
+}
+
+void thermal_model_reset()
+{
+  for (int h = 0; h <= EXTRUDERS; h++)
+    tm_running[h] = false;
+}
+#endif //THERMAL_MODEL_PROTECTION
+
+#ifdef TEMP_TELEMETRY
+#define TELEMETRY_HEATERS (EXTRUDERS + 1) // last one is the bed
+typedef struct
+{
+  unsigned long ms;
+  int temp[TELEMETRY_HEATERS]; // 0.1 degC
+  int target[TELEMETRY_HEATERS];
+  unsigned char pwm[TELEMETRY_HEATERS];
+  unsigned char fan;
+} telemetry_sample_t;
+
+static telemetry_sample_t telemetry_buf[TEMP_TELEMETRY_SIZE];
+static unsigned char telemetry_head = 0; // next slot to write
+static unsigned char telemetry_count = 0;
+static unsigned long telemetry_last = 0;
+unsigned long telemetry_interval = TEMP_TELEMETRY_INTERVAL;
+#ifdef SDSUPPORT
+static unsigned char telemetry_unlogged = 0; // newest samples not appended to TEMP_TELEMETRY_FILE yet
+static bool telemetry_logging = false;       // the file was started for the print file that is open
+#endif
+
+// called with fresh readings, soft_pwm is still what was applied while they were measured
+static void telemetry_sample()
+{
+  if (telemetry_interval == 0 || millis() - telemetry_last < telemetry_interval)
+    return;
+  telemetry_last = millis();
+
+  telemetry_sample_t *s = &telemetry_buf[telemetry_head];
+  s->ms = telemetry_last;
+  for (int e = 0; e < EXTRUDERS; e++)
+  {
+    s->temp[e] = current_temperature[e] * 10;
+    s->target[e] = target_temperature[e];
+    s->pwm[e] = soft_pwm[e];
+  }
+  s->temp[EXTRUDERS] = current_temperature_bed * 10;
+  s->target[EXTRUDERS] = target_temperature_bed;
+  s->pwm[EXTRUDERS] = soft_pwm_bed;
+  s->fan = fanSpeed;
+
+  if (++telemetry_head >= TEMP_TELEMETRY_SIZE)
+    telemetry_head = 0;
+  if (telemetry_count < TEMP_TELEMETRY_SIZE)
+    telemetry_count++;
+#ifdef SDSUPPORT
+  if (telemetry_unlogged < TEMP_TELEMETRY_SIZE)
+    telemetry_unlogged++;
+#endif
+}
+
+void telemetry_clear()
+{
+  telemetry_head = 0;
+  telemetry_count = 0;
+#ifdef SDSUPPORT
+  telemetry_unlogged = 0;
+#endif
+}
+
+static void telemetry_header(char *buf)
+{
+  strcpy_P(buf, PSTR("ms"));
+  for (int e = 0; e < EXTRUDERS; e++)
+    sprintf_P(buf + strlen(buf), PSTR(",T%d,T%d_target,T%d_pwm"), e, e, e);
+  strcat_P(buf, PSTR(",B,B_target,B_pwm,fan"));
+}
+
+static void telemetry_line(char *buf, const telemetry_sample_t *s)
+{
+  int n = sprintf_P(buf, PSTR("%lu"), s->ms);
+  for (int h = 0; h < TELEMETRY_HEATERS; h++)
+  {
+    int t = s->temp[h];
+    n += sprintf_P(buf + n, PSTR(",%s%d.%d,%d,%u"), t < 0 ? "-" : "", abs(t) / 10, abs(t) % 10, s->target[h], s->pwm[h]);
+  }
+  sprintf_P(buf + n, PSTR(",%u"), s->fan);
+}
+
+// i-th oldest of the samples kept
+static const telemetry_sample_t *telemetry_at(int i)
+{
+  return &telemetry_buf[(telemetry_head + TEMP_TELEMETRY_SIZE - telemetry_count + i) % TEMP_TELEMETRY_SIZE];
+}
+
+#ifdef SDSUPPORT
+// Header and then samples from the i-th oldest on
+static void telemetry_write(SdFile &f, bool header, int i)
+{
+  char line[100];
+  if (header)
+  {
+    telemetry_header(line);
+    f.write(line);
+    f.write("\r\n");
+  }
+  for (; i < telemetry_count; i++)
+  {
+    telemetry_line(line, telemetry_at(i));
+    f.write(line);
+    f.write("\r\n");
+  }
+}
+
+// Called from manage_inactivity(): while a file is printed from SD the samples are appended to
+// TEMP_TELEMETRY_FILE half a buffer at a time, so it covers the whole print. The file is started
+// over for each print file and gets the last samples when the print file is closed.
+void telemetry_log()
+{
+  bool printing = card.isFileOpen() && !card.saving;
+  if (printing && !telemetry_logging && card.sdprinting != 1)
+    return;
+  if (printing && telemetry_unlogged < TEMP_TELEMETRY_SIZE / 2)
+    return;
+  if (!printing && (!telemetry_logging || telemetry_unlogged == 0))
+  {
+    telemetry_logging = false;
+    return;
+  }
+  SdFile f;
+  if (card.openRootFile(f, TEMP_TELEMETRY_FILE, O_CREAT | O_WRITE | (telemetry_logging ? O_APPEND : O_TRUNC)))
+  {
+    telemetry_write(f, !telemetry_logging, telemetry_count - telemetry_unlogged);
+    f.close();
+  }
+  telemetry_unlogged = 0;
+  telemetry_logging = printing;
+}
+#endif
+
+// Oldest sample first. toSD writes TEMP_TELEMETRY_FILE instead of printing the lines.
+void telemetry_dump(bool toSD)
+{
+  char line[100];
+#ifdef SDSUPPORT
+  if (toSD)
+  {
+    SdFile f;
+    if (telemetry_logging)
+    {
+      SERIAL_PROTOCOLLNPGM("The print is logged to " TEMP_TELEMETRY_FILE);
+      return;
+    }
+    if (!card.openRootFile(f, TEMP_TELEMETRY_FILE, O_CREAT | O_WRITE | O_TRUNC))
+    {
+      SERIAL_ERROR_START;
+      SERIAL_ERRORLNPGM("Open " TEMP_TELEMETRY_FILE " failed");
+      return;
+    }
+    telemetry_write(f, true, 0);
+    f.close();
+    SERIAL_PROTOCOL((int)telemetry_count);
+    SERIAL_PROTOCOLLNPGM(" samples written to " TEMP_TELEMETRY_FILE);
+    return;
+  }
+#endif
+
+  telemetry_header(line);
+  SERIAL_PROTOCOLLN(line);
+  for (int i = 0; i < telemetry_count; i++)
+  {
+    telemetry_line(line, telemetry_at(i));
+    SERIAL_PROTOCOLLN(line);
+  }
+}
+#endif //TEMP_TELEMETRY
+
+#ifdef HEATER_POWER_BUDGET
+// Hotends first, the bed only gets what is left of the budget.
+// Only lowers soft_pwm_bed, the bed control raises it again on its next check.
+static void limit_heater_power()
+{
+  long left = (long)HEATER_POWER_BUDGET * (PID_MAX >> 1);
+  for (int e = 0; e < EXTRUDERS; e++)
+    left -= (long)soft_pwm[e] * HOTEND_WATTS;
+  if (left < 0)
+    left = 0;
+  long bed_max = left / BED_WATTS;
+  if (soft_pwm_bed > bed_max)
+    soft_pwm_bed = bed_max;
+}
+#endif
+
 void manage_heater()
 {
   float pid_input;
@@ -444,9 +763,17 @@ void manage_heater()
 
   updateTemperaturesFromRawValues();
 
+#ifdef TEMP_TELEMETRY
+  telemetry_sample();
+#endif
+
   int iHF = 0;
   for (int e = 0; e < EXTRUDERS; e++)
   {
+#ifdef THERMAL_MODEL_PROTECTION
+    // before soft_pwm changes, the model needs the pwm of the period just measured
+    iHF = thermal_model_check(e, current_temperature[e], soft_pwm[e]);
+#endif
 
 #ifdef PIDTEMP
     pid_input = current_temperature[e];
@@ -539,7 +866,9 @@ void manage_heater()
       watch_start_temp_fall[e] = degHotend(e);
       watchmillis_fall[e] = millis();
     }
+#endif //WATCH_TEMP_PERIOD
 
+#if defined(WATCH_TEMP_PERIOD) || defined(THERMAL_MODEL_PROTECTION)
     if (iHF != 0)
     {
       tl_HEATER_FAIL = true;
@@ -549,6 +878,7 @@ void manage_heater()
 #else
       setTargetHotend(0, e);
 #endif
+      soft_pwm[e] = 0;
 
       //LCD_MESSAGEPGM("Heating failed");
       SERIAL_ECHO_START;
@@ -574,9 +904,7 @@ void manage_heater()
 
       return;
     }
-
 #endif
-    //WATCH_TEMP_PERIOD
 
 #ifdef TEMP_SENSOR_1_AS_REDUNDANT
     if (fabs(current_temperature[0] - redundant_temperature) > MAX_REDUNDANT_TEMP_SENSOR_DIFF)
@@ -605,6 +933,31 @@ void manage_heater()
   }
 #endif
 
+#if defined(THERMAL_MODEL_PROTECTION) && (TEMP_SENSOR_BED != 0)
+  // every reading, not only every BED_CHECK_INTERVAL
+  iHF = thermal_model_check(EXTRUDERS, current_temperature_bed, soft_pwm_bed);
+  if (iHF != 0)
+  {
+    tl_HEATER_FAIL = true;
+    target_temperature_bed = 0;
+    soft_pwm_bed = 0;
+#if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
+    WRITE(HEATER_BED_PIN, LOW);
+#endif
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLN("Bed heating failed");
+#ifdef TL_DWN_CONTROLLER
+    sTempErrMsg = "Bed, ErrNO:" + String(iHF);
+#endif
+    iTempErrID = MSG_BED_HIGH_TEMP_ERROR;
+    return;
+  }
+#endif
+
+#ifdef HEATER_POWER_BUDGET
+  limit_heater_power();
+#endif
+
 #ifndef PIDTEMPBED
   if (millis() - previous_millis_bed_heater < BED_CHECK_INTERVAL)
     return;
@@ -692,6 +1045,9 @@ void manage_heater()
     WRITE(HEATER_BED_PIN, LOW);
   }
 #endif
+#endif
+#ifdef HEATER_POWER_BUDGET
+  limit_heater_power();
 #endif
   return;
 }
@@ -799,6 +1155,73 @@ static void updateTemperaturesFromRawValues()
   CRITICAL_SECTION_END;
 }
 
+#ifdef TEMP_ADC_FREE_RUNNING
+// Move to the next channel with a sensor, false when the round is complete.
+static bool adc_select_channel(unsigned char ch)
+{
+  while (ch < ADC_CHANNELS && adc_channel_pin[ch] < 0)
+    ch++;
+  adc_channel = ch;
+  if (ch >= ADC_CHANNELS)
+    return false;
+  // No conversion is running here, so the mux change takes effect at once
+  ADCSRB = (adc_channel_pin[ch] > 7) ? (1 << MUX5) : 0;
+  ADMUX = ((1 << REFS0) | (adc_channel_pin[ch] & 0x07));
+  return true;
+}
+
+// Must be called with interrupts disabled
+static void adc_start_round()
+{
+  for (unsigned char i = 0; i < ADC_CHANNELS; i++)
+    adc_sum[i] = 0;
+  adc_sample_count = 0;
+  adc_median_count = 0;
+  if (adc_select_channel(0))
+  {
+    adc_round_done = false;
+    ADCSRA |= 1 << ADSC;
+  }
+}
+
+static FORCE_INLINE unsigned int adc_median()
+{
+#if TEMP_ADC_MEDIAN > 1
+  for (unsigned char i = 1; i < TEMP_ADC_MEDIAN; i++)
+  {
+    unsigned int v = adc_median_buf[i];
+    unsigned char j = i;
+    for (; j > 0 && adc_median_buf[j - 1] > v; j--)
+      adc_median_buf[j] = adc_median_buf[j - 1];
+    adc_median_buf[j] = v;
+  }
+#endif
+  return adc_median_buf[TEMP_ADC_MEDIAN / 2];
+}
+
+// Conversion complete: keep the median of every TEMP_ADC_MEDIAN conversions and chain the next one.
+// The round stops after the last channel, Temp_Controll picks it up and starts the next round.
+ISR(ADC_vect)
+{
+  adc_median_buf[adc_median_count++] = ADC;
+  if (adc_median_count >= TEMP_ADC_MEDIAN)
+  {
+    adc_median_count = 0;
+    adc_sum[adc_channel] += adc_median();
+    if (++adc_sample_count >= TEMP_ADC_OVERSAMPLE)
+    {
+      adc_sample_count = 0;
+      if (!adc_select_channel(adc_channel + 1))
+      {
+        adc_round_done = true;
+        return;
+      }
+    }
+  }
+  ADCSRA |= 1 << ADSC;
+}
+#endif //TEMP_ADC_FREE_RUNNING
+
 void tp_init()
 {
 #if (MOTHERBOARD == 80) && ((TEMP_SENSOR_0 == -1) || (TEMP_SENSOR_1 == -1) || (TEMP_SENSOR_2 == -1) || (TEMP_SENSOR_BED == -1))
@@ -861,7 +1284,11 @@ void tp_init()
 #endif
 
   // Set analog inputs
+#ifdef TEMP_ADC_FREE_RUNNING
+  ADCSRA = 1 << ADEN | 1 << ADIF | 1 << ADIE | 0x07;
+#else
   ADCSRA = 1 << ADEN | 1 << ADSC | 1 << ADIF | 0x07;
+#endif
   DIDR0 = 0;
 #ifdef DIDR2
   DIDR2 = 0;
@@ -900,6 +1327,12 @@ void tp_init()
   OCR0B = 128;
   TIMSK0 |= (1 << OCIE0B);
 
+#ifdef TEMP_ADC_FREE_RUNNING
+  CRITICAL_SECTION_START;
+  adc_start_round();
+  CRITICAL_SECTION_END;
+#endif
+
   // Wait for temperature measurement to settle
   delay(250);
 
@@ -1328,6 +1761,25 @@ void Temp_Controll()
   pwm_count += (1 << SOFT_PWM_SCALE);
   pwm_count &= 0x7f;
 
+#ifdef TEMP_ADC_FREE_RUNNING
+  // Conversions run in ISR(ADC_vect), only pace the readings here so PID_dT stays the same
+  if (++temp_state >= 8 * 16) // 1 ms * 128 = 128ms, as the state machine below
+  {
+    temp_state = 0;
+    if (adc_round_done)
+    {
+      raw_temp_0_value = ADC_SCALE(adc_sum[0]);
+      raw_temp_bed_value = ADC_SCALE(adc_sum[1]);
+      raw_temp_1_value = ADC_SCALE(adc_sum[2]);
+      raw_temp_2_value = ADC_SCALE(adc_sum[3]);
+#ifdef HEATER_0_USES_MAX6675
+      raw_temp_0_value = read_max6675();
+#endif
+      temp_count = 16;
+      adc_start_round();
+    }
+  }
+#else
   switch (temp_state)
   {
   case 0: // Prepare TEMP_0
@@ -1415,6 +1867,7 @@ void Temp_Controll()
     //      SERIAL_ERRORLNPGM("Temp measurement error!");
     //      break;
   }
+#endif //TEMP_ADC_FREE_RUNNING
 
   if (temp_count >= 16) // 8 ms * 16 = 128ms.
   {
@@ -56,6 +56,24 @@ float unscalePID_d(float d);
 extern float bedKp, bedKi, bedKd;
 #endif
 
+#ifdef THERMAL_MODEL_PROTECTION
+extern float tm_gain[EXTRUDERS + 1];
+extern float tm_tau[EXTRUDERS + 1];
+extern int tm_tolerance;
+extern int tm_count;
+extern bool tm_enabled;
+void thermal_model_reset();
+#endif
+
+#ifdef TEMP_TELEMETRY
+extern unsigned long telemetry_interval;
+void telemetry_clear();
+void telemetry_dump(bool toSD);
+#ifdef SDSUPPORT
+void telemetry_log();
+#endif
+#endif
+
 //high level conversion routines, for use outside of temperature.cpp
 //inline so that there is no performance decrease.
 //deg=degreeCelsius
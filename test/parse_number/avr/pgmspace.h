@@ -0,0 +1,6 @@
+// Host stand-in for avr-libc's pgmspace.h: flash is ordinary memory here
+#ifndef PGMSPACE_H
+#define PGMSPACE_H
+#define PROGMEM
+#define pgm_read_float(p) (*(const float *)(p))
+#endif
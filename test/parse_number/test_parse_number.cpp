@@ -0,0 +1,120 @@
+// Host test for Marlin/parse_number.cpp: parse_float()/parse_long() against strtod()/strtol()
+// on the number forms hosts and slicers send, plus a rough per-call timing of both.
+// Build and run with "make" in this directory.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <random>
+#include "parse_number.h"
+
+static std::mt19937 rng(12345);
+
+// Number in G-code form followed by what may come after it on a line
+static void make_number(char *buf, bool integer)
+{
+    const char *sign[] = {"", "", "-", "+"};
+    const char *tail[] = {"", " ", " X12.5", "*71", "\n"};
+    char digits[24];
+    int n = 0;
+    int whole = rng() % 10; // up to 9 integer digits
+    for (int i = 0; i < whole; i++)
+        digits[n++] = '0' + rng() % 10;
+    if (n == 0 || rng() % 4 == 0)
+        digits[n++] = '0' + rng() % 10;
+    if (!integer && rng() % 3)
+    {
+        digits[n++] = '.';
+        int places = rng() % 7;
+        for (int i = 0; i < places; i++)
+            digits[n++] = '0' + rng() % 10;
+    }
+    digits[n] = 0;
+    sprintf(buf, "%s%s%s%s", rng() % 5 ? "" : "  ", sign[rng() % 4], digits, tail[rng() % 5]);
+}
+
+// Distance in float steps between a and b
+static long ulps(float a, float b)
+{
+    if (a == b)
+        return 0;
+    int32_t ia, ib;
+    memcpy(&ia, &a, 4);
+    memcpy(&ib, &b, 4);
+    if (ia < 0)
+        ia = 0x80000000 - ia;
+    if (ib < 0)
+        ib = 0x80000000 - ib;
+    return labs((long)ia - (long)ib);
+}
+
+int main()
+{
+    const int N = 1000000;
+    char buf[48];
+    long worst = 0;
+    int bad = 0;
+    for (int i = 0; i < N; i++)
+    {
+        make_number(buf, false);
+        char *want_end;
+        const char *got_end;
+        float want = (float)strtod(buf, &want_end);
+        float got = parse_float(buf, &got_end);
+        long u = ulps(got, want);
+        if (got_end != want_end && bad++ < 10)
+            printf("parse_float(\"%s\") ends at %d, strtod at %d\n", buf, (int)(got_end - buf), (int)(want_end - buf));
+        if (u > worst)
+            worst = u;
+        if (u > 2 && bad++ < 10)
+            printf("parse_float(\"%s\") = %.9g, strtod %.9g\n", buf, got, want);
+    }
+    printf("parse_float: %d numbers, worst %ld ulp, %d off by more than 2 or ending elsewhere\n", N, worst, bad);
+
+    int badl = 0;
+    for (int i = 0; i < N; i++)
+    {
+        make_number(buf, true);
+        char *want_end;
+        const char *got_end;
+        long want = strtol(buf, &want_end, 10);
+        long got = parse_long(buf, &got_end);
+        if ((got != want || got_end != want_end) && badl++ < 10)
+            printf("parse_long(\"%s\") = %ld, strtol %ld\n", buf, got, want);
+    }
+    printf("parse_long: %d numbers, %d different\n", N, badl);
+
+    // no number at all: the end stays where the parse started, as for strtod/strtol
+    const char *none[] = {"", " ", "-", "+", ".", "-.", "X5", " d"};
+    for (unsigned i = 0; i < sizeof(none) / sizeof(none[0]); i++)
+    {
+        const char *fe, *le;
+        parse_float(none[i], &fe);
+        parse_long(none[i], &le);
+        if (fe != none[i] || le != none[i])
+        {
+            printf("\"%s\" is taken for a number\n", none[i]);
+            badl++;
+        }
+    }
+
+    // timing on the host only shows the ratio, the AVR one is what matters on the printer
+    static char lines[1000][48];
+    for (int i = 0; i < 1000; i++)
+        make_number(lines[i], false);
+    volatile float sink = 0;
+    clock_t t = clock();
+    for (int r = 0; r < 1000; r++)
+        for (int i = 0; i < 1000; i++)
+            sink += parse_float(lines[i]);
+    double own = (double)(clock() - t) / CLOCKS_PER_SEC;
+    t = clock();
+    for (int r = 0; r < 1000; r++)
+        for (int i = 0; i < 1000; i++)
+            sink += strtod(lines[i], NULL);
+    double libc = (double)(clock() - t) / CLOCKS_PER_SEC;
+    printf("ns per number: parse_float %.1f, strtod %.1f\n", own * 1000, libc * 1000);
+
+    return (bad || badl) ? 1 : 0;
+}